@@ -0,0 +1,438 @@
+/*
+ * Micro-benchmarks for the allocator (`make bench`).
+ * Each scenario runs once per allocator: this one under every search policy, and the system malloc for comparison.
+ * Every run happens in a child process of its own, so each starts from an empty heap and the fragmentation figures are not skewed by earlier runs.
+ * Reported per run: throughput, per-operation latency percentiles, and fragmentation at peak live memory.
+ * The benchmark's own bookkeeping is mapped with mmap, so it does not disturb either allocator.
+ */
+
+#include "main.h"
+#include <malloc.h>
+#include <time.h>
+#include <sys/wait.h>
+
+// The producer/consumer scenario frees blocks in other threads than the ones that allocated them.
+#ifndef ALLOC_THREADS
+#error "bench.c needs the thread-safe allocator (-DALLOC_THREADS); build it with `make bench`"
+#endif
+
+// Operations per run unless given on the command line.
+#define Benchops 200000
+
+// Live blocks kept by the churn scenarios, and the largest size the random distribution draws.
+#define Benchslots 4096
+#define Benchmaxsize 8192
+
+// Producer/consumer threads come in pairs, linked by a ring of this many pointers.
+#define Benchpairs 2
+#define Benchring 1024
+
+// Fragmentation is sampled every this many operations.
+#define Benchsample 256
+
+// An allocator under test.
+struct s_allocator
+{
+    const char *name;
+    int32 policy;                              // Search policy, for this allocator only.
+    void *(*alloc)(size_t bytes);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t bytes);
+    size_t (*footprint)(void);                 // Bytes the allocator currently holds from the OS.
+};
+
+typedef struct s_allocator allocator;
+
+// Per-run measurements.
+struct s_run
+{
+    const allocator *with;
+    word ops;            // Operations timed so far.
+    int32 *lat;          // Latency of every timed operation, in nanoseconds.
+    size_t live;         // Bytes the benchmark currently holds.
+    size_t peaklive;     // Highest `live` seen at a sample.
+    size_t peakfoot;     // Footprint at that sample.
+};
+
+typedef struct s_run run;
+
+// Footprint of this allocator: the part of every chunk below its high-water mark, which is all the memory it has touched.
+// That is what the system malloc's figures count too, rather than the whole of memspace and of every mapped chunk.
+// Directly mapped blocks are not counted; the scenarios stay below the mmap threshold.
+static size_t heapFootprint(void)
+{
+    size_t bytes = 0;
+
+    for (word i = 0; i < Arenas; i++)
+    {
+        arena *a = &arenas[i];
+
+        lockarena(a);
+        for (chunk *c = a->tail ? &a->first : NULL; c; c = c->next)
+            bytes += c->clean - (char *)c->base;
+        unlockarena(a);
+    }
+
+    return bytes;
+}
+
+static size_t sysFootprint(void)
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.arena + mi.hblkhd;
+}
+
+static const allocator allocators[] = {
+    {"alloc/bins", FitBins, alloc, freealloc, realloc_block, heapFootprint},
+    {"alloc/first", FitFirst, alloc, freealloc, realloc_block, heapFootprint},
+    {"alloc/next", FitNext, alloc, freealloc, realloc_block, heapFootprint},
+    {"alloc/best", FitBest, alloc, freealloc, realloc_block, heapFootprint},
+#ifdef ALLOC_FREEMAP
+    {"alloc/map", FitMap, alloc, freealloc, realloc_block, heapFootprint},
+#endif
+    {"malloc", FitBins, malloc, free, realloc, sysFootprint},
+};
+
+// Anonymous memory for the benchmark's own tables.
+static void *benchMap(size_t bytes)
+{
+    void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        perror("bench: mmap");
+        exit(1);
+    }
+    return p;
+}
+
+static inline int64 now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Small, fast PRNG (xorshift64) so the scenarios are reproducible and cost next to nothing.
+static inline int64 rnd(int64 *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Sizes skewed towards small objects: a uniform power of two from Benchmaxsize down to Benchmaxsize / 1024, then a uniform size up to it.
+static size_t randomSize(int64 *state)
+{
+    size_t top = Benchmaxsize >> rnd(state) % 11;
+    return 1 + rnd(state) % top;
+}
+
+// Records the latency of one operation and, every Benchsample operations, the memory in use.
+// Threads of the producer/consumer scenario share one run, so its counters are updated atomically.
+static inline void record(run *r, int64 start)
+{
+    word n = __atomic_fetch_add(&r->ops, 1, __ATOMIC_RELAXED);
+    r->lat[n] = (int32)(now() - start);
+
+    if (n % Benchsample == 0)
+    {
+        size_t live = __atomic_load_n(&r->live, __ATOMIC_RELAXED);
+        if (live > __atomic_load_n(&r->peaklive, __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&r->peaklive, live, __ATOMIC_RELAXED);
+            __atomic_store_n(&r->peakfoot, r->with->footprint(), __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void *timedAlloc(run *r, size_t bytes)
+{
+    int64 start = now();
+    void *p = r->with->alloc(bytes);
+    record(r, start);
+
+    if (!p)
+    {
+        fprintf(stderr, "bench: %s: allocation of %zu bytes failed\n", r->with->name, bytes);
+        exit(1);
+    }
+
+    // Touch the block so the allocators are compared on memory that is actually used.
+    *(char *)p = 1;
+    __atomic_fetch_add(&r->live, bytes, __ATOMIC_RELAXED);
+    return p;
+}
+
+static void timedFree(run *r, void *p, size_t bytes)
+{
+    __atomic_fetch_sub(&r->live, bytes, __ATOMIC_RELAXED);
+
+    int64 start = now();
+    r->with->free(p);
+    record(r, start);
+}
+
+/*
+ * Fixed-size churn: a working set of Benchslots 64-byte objects, one of which is replaced at random per step.
+ */
+static void benchFixed(run *r, word ops)
+{
+    void **slot = benchMap(Benchslots * sizeof(void *));
+    int64 state = 88172645463325252ull;
+
+    for (word n = 0; n < ops / 2; n++)
+    {
+        word i = rnd(&state) % Benchslots;
+        if (slot[i])
+            timedFree(r, slot[i], 64);
+        slot[i] = timedAlloc(r, 64);
+    }
+
+    for (word i = 0; i < Benchslots; i++)
+        if (slot[i])
+            timedFree(r, slot[i], 64);
+}
+
+/*
+ * Random sizes: like the fixed-size churn, with sizes drawn from a small-object-heavy distribution.
+ */
+static void benchRandom(run *r, word ops)
+{
+    void **slot = benchMap(Benchslots * sizeof(void *));
+    size_t *size = benchMap(Benchslots * sizeof(size_t));
+    int64 state = 88172645463325252ull;
+
+    for (word n = 0; n < ops / 2; n++)
+    {
+        word i = rnd(&state) % Benchslots;
+        if (slot[i])
+            timedFree(r, slot[i], size[i]);
+        size[i] = randomSize(&state);
+        slot[i] = timedAlloc(r, size[i]);
+    }
+
+    for (word i = 0; i < Benchslots; i++)
+        if (slot[i])
+            timedFree(r, slot[i], size[i]);
+}
+
+/*
+ * Batches of Benchslots random-sized objects, freed in reverse (LIFO) or allocation (FIFO) order.
+ */
+static void benchOrder(run *r, word ops, bool lifo)
+{
+    void **slot = benchMap(Benchslots * sizeof(void *));
+    size_t *size = benchMap(Benchslots * sizeof(size_t));
+    int64 state = 88172645463325252ull;
+
+    for (word done = 0; done < ops; done += 2 * Benchslots)
+    {
+        for (word i = 0; i < Benchslots; i++)
+        {
+            size[i] = randomSize(&state);
+            slot[i] = timedAlloc(r, size[i]);
+        }
+
+        for (word k = 0; k < Benchslots; k++)
+        {
+            word i = lifo ? Benchslots - 1 - k : k;
+            timedFree(r, slot[i], size[i]);
+        }
+    }
+}
+
+static void benchLifo(run *r, word ops)
+{
+    benchOrder(r, ops, true);
+}
+
+static void benchFifo(run *r, word ops)
+{
+    benchOrder(r, ops, false);
+}
+
+/*
+ * Realloc growth: buffers that grow by half their size up to 64 KB, as dynamic arrays and string builders do,
+ * interleaved with small allocations that get in their way.
+ */
+static void benchRealloc(run *r, word ops)
+{
+    void **small = benchMap(Benchslots * sizeof(void *));
+    word nsmall = 0;
+
+    while (r->ops < ops)
+    {
+        size_t bytes = 16;
+        void *buf = timedAlloc(r, bytes);
+
+        while (bytes < 64 * 1024 && r->ops < ops)
+        {
+            size_t grown = bytes + bytes / 2;
+
+            int64 start = now();
+            buf = r->with->realloc(buf, grown);
+            record(r, start);
+
+            if (!buf)
+            {
+                fprintf(stderr, "bench: %s: realloc to %zu bytes failed\n", r->with->name, grown);
+                exit(1);
+            }
+            ((char *)buf)[grown - 1] = 1;
+            __atomic_fetch_add(&r->live, grown - bytes, __ATOMIC_RELAXED);
+            bytes = grown;
+
+            if (nsmall < Benchslots && bytes % 3 == 0)
+                small[nsmall++] = timedAlloc(r, 32);
+        }
+
+        timedFree(r, buf, bytes);
+        if (nsmall == Benchslots)
+        {
+            while (nsmall)
+                timedFree(r, small[--nsmall], 32);
+        }
+    }
+
+    while (nsmall)
+        timedFree(r, small[--nsmall], 32);
+}
+
+// One producer/consumer pair: the producer allocates, the consumer frees what it finds on the ring.
+struct s_pair
+{
+    run *r;
+    word ops;
+    void *ring[Benchring];
+    word head; // Next slot the producer fills (written by the producer only).
+    word tail; // Next slot the consumer empties (written by the consumer only).
+};
+
+static void *producer(void *arg)
+{
+    struct s_pair *p = arg;
+
+    for (word n = 0; n < p->ops; n++)
+    {
+        void *block = timedAlloc(p->r, 128);
+
+        while (__atomic_load_n(&p->head, __ATOMIC_RELAXED) - __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE) == Benchring)
+            sched_yield();
+
+        p->ring[p->head % Benchring] = block;
+        __atomic_store_n(&p->head, p->head + 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    struct s_pair *p = arg;
+
+    for (word n = 0; n < p->ops; n++)
+    {
+        while (__atomic_load_n(&p->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&p->tail, __ATOMIC_RELAXED))
+            sched_yield();
+
+        void *block = p->ring[p->tail % Benchring];
+        __atomic_store_n(&p->tail, p->tail + 1, __ATOMIC_RELEASE);
+
+        timedFree(p->r, block, 128);
+    }
+
+    return NULL;
+}
+
+/*
+ * Producer/consumer: Benchpairs pairs of threads, each freeing in one thread what was allocated in another.
+ */
+static void benchProducer(run *r, word ops)
+{
+    struct s_pair *pairs = benchMap(Benchpairs * sizeof(struct s_pair));
+    pthread_t threads[2 * Benchpairs];
+
+    for (word i = 0; i < Benchpairs; i++)
+    {
+        pairs[i].r = r;
+        pairs[i].ops = ops / 2 / Benchpairs;
+        pthread_create(&threads[2 * i], NULL, producer, &pairs[i]);
+        pthread_create(&threads[2 * i + 1], NULL, consumer, &pairs[i]);
+    }
+
+    for (word i = 0; i < 2 * Benchpairs; i++)
+        pthread_join(threads[i], NULL);
+}
+
+static const struct
+{
+    const char *name;
+    void (*body)(run *r, word ops);
+} scenarios[] = {
+    {"fixed-64", benchFixed},
+    {"random", benchRandom},
+    {"lifo", benchLifo},
+    {"fifo", benchFifo},
+    {"realloc", benchRealloc},
+    {"prod-cons", benchProducer},
+};
+
+static int byLatency(const void *x, const void *y)
+{
+    int32 p = *(const int32 *)x, q = *(const int32 *)y;
+    return (p > q) - (p < q);
+}
+
+/*
+ * Runs one scenario with one allocator and prints its results.
+ * Called in a fresh child process, so the allocator's heap starts out empty.
+ */
+static void benchRun(word s, const allocator *with, word ops)
+{
+    // Scenarios finish the batch or working set they are in when they reach `ops`, which takes at most 3 * Benchslots more operations.
+    run r = {.with = with, .lat = benchMap((ops + 3 * Benchslots) * sizeof(int32))};
+
+    setpolicy(with->policy);
+
+    int64 start = now();
+    scenarios[s].body(&r, ops);
+    double secs = (now() - start) / 1e9;
+
+    qsort(r.lat, r.ops, sizeof(int32), byLatency);
+
+    double frag = r.peakfoot ? 100.0 * (1.0 - (double)r.peaklive / r.peakfoot) : 0.0;
+    printf("%-10s %-12s %12.0f %8u %8u %8u %9.1f%%\n", scenarios[s].name, with->name, r.ops / secs,
+           r.lat[r.ops / 2], r.lat[r.ops * 99 / 100], r.lat[r.ops * 999 / 1000], frag < 0 ? 0.0 : frag);
+}
+
+int main(int argc, char **argv)
+{
+    word ops = argc > 1 ? strtoul(argv[1], NULL, 10) : Benchops;
+
+    printf("%lu operations per run, %d arena(s)\n", ops, Arenas);
+    printf("%-10s %-12s %12s %8s %8s %8s %10s\n", "scenario", "allocator", "ops/s", "p50 ns", "p99 ns", "p999 ns", "frag@peak");
+
+    for (word s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++)
+    {
+        for (word a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++)
+        {
+            fflush(stdout);
+
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                benchRun(s, &allocators[a], ops);
+                fflush(stdout);
+                _exit(0);
+            }
+
+            int status;
+            waitpid(pid, &status, 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status))
+                printf("%-10s %-12s failed\n", scenarios[s].name, allocators[a].name);
+        }
+    }
+
+    return 0;
+}
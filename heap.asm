@@ -1,11 +1,20 @@
 ; Assembly file defining the memory space for our custom allocator
 ; This file reserves a large, uninitialized block of memory to be used as our heap
 
+%ifidn __OUTPUT_FORMAT__, elf64
+bits 64                           ; 64-bit build (nasm -f elf64)
+%else
 bits 32                           ; Specify 32-bit code generation
+%endif
 global memspace                   ; Export the 'memspace' symbol for use in C code
 
-; Define heap size as 1MB in 4-byte words (262144 words)
-%define Heapsize (1024 * 1024 / 4)  
+; Heap size in bytes; override with nasm -DHeapbytes=N (must match the C side, see main.h)
+%ifndef Heapbytes
+%define Heapbytes (1024 * 1024)
+%endif
+
+; Define heap size in 4-byte double words (262144 for the default 1MB)
+%define Heapsize (Heapbytes / 4)
 
 ; .bss section is for uninitialized memory - perfect for our heap
 ; Memory in the .bss section is reserved by the linker but is not part of the executable image.
@@ -0,0 +1,276 @@
+/*
+ * Renders fragmentation heatmaps from heap snapshots written by alloc_snapshot_fd() (`make heatmap`).
+ * Every chunk is drawn as a grid of cells, each covering an equal share of the chunk's words, with a summary line above it.
+ * Free space is split into usable free blocks and holes: free blocks smaller than the hole size (-H), which fit few requests.
+ * Text output shows each cell's state with one character (see the legend it prints); -o also writes a PPM image in which
+ * allocated memory is blue, usable free memory green and holes red, mixed in proportion within each cell.
+ * The tool only reads the snapshot format from main.h and does not link the allocator.
+ */
+
+#include "main.h"
+
+// Cells per row and rows per chunk unless given on the command line, and the default hole size in bytes.
+#define Heatwidth 64
+#define Heatrows 16
+#define Heathole 256
+
+// Words of each kind in one cell.
+struct s_cell
+{
+    double alloced;
+    double free;
+    double hole;
+};
+
+typedef struct s_cell cell;
+
+static const char *snapname;
+
+static void corrupt(void)
+{
+    fprintf(stderr, "heatmap: %s: truncated or corrupted snapshot\n", snapname);
+    exit(1);
+}
+
+// Reads an unsigned LEB128 varint at `*p`, which must end before `end`.
+static int64 getVarint(const int8 **p, const int8 *end)
+{
+    int64 v = 0;
+    for (int32 shift = 0; shift < 64; shift += 7)
+    {
+        if (*p >= end)
+            corrupt();
+        int8 b = *(*p)++;
+        v |= (int64)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return v;
+    }
+    corrupt();
+    return 0;
+}
+
+// Reads the whole snapshot file at `path` ("-" for standard input) and stores its length in `bytes`.
+static int8 *readSnapshot(const char *path, size_t *bytes)
+{
+    FILE *f = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+    if (!f)
+    {
+        perror(path);
+        exit(1);
+    }
+
+    size_t size = 64 * 1024, n = 0;
+    int8 *buf = malloc(size);
+    for (size_t got; buf && (got = fread(buf + n, 1, size - n, f)) > 0;)
+    {
+        n += got;
+        if (n == size)
+            buf = realloc(buf, size *= 2);
+    }
+    if (!buf)
+    {
+        fprintf(stderr, "heatmap: out of memory\n");
+        exit(1);
+    }
+
+    if (f != stdin)
+        fclose(f);
+    *bytes = n;
+    return buf;
+}
+
+// Adds `words` words of the given kind (0 allocated, 1 free, 2 hole), starting `start` words into a chunk of `ncells` cells.
+static void spread(cell *cells, word ncells, double cellwords, int64 start, int64 words, int32 kind)
+{
+    while (words)
+    {
+        int64 c = (int64)(start / cellwords);
+        if (c >= ncells)
+            c = ncells - 1;
+        int64 upto = (int64)((c + 1) * cellwords);
+        int64 n = c == ncells - 1 || upto - start >= words ? words : upto - start;
+        if (n <= 0)
+            n = 1;
+
+        double *dst = kind == 0 ? &cells[c].alloced : kind == 1 ? &cells[c].free : &cells[c].hole;
+        *dst += n;
+
+        start += n;
+        words -= n;
+    }
+}
+
+// Character for a cell: blank when free, '#' when full, shades of allocation in between, and 'x' when holes dominate its free space.
+static char cellChar(const cell *c)
+{
+    double total = c->alloced + c->free + c->hole;
+    if (total == 0)
+        return ' ';
+    if (c->hole > c->free && c->hole > 0)
+        return 'x';
+
+    double used = c->alloced / total;
+    return used == 0 ? ' ' : used < 0.25 ? '.' : used < 0.5 ? ':' : used < 0.75 ? '+' : used < 1 ? '*' : '#';
+}
+
+int main(int argc, char **argv)
+{
+    word width = Heatwidth, rows = Heatrows, holebytes = Heathole;
+    const char *image = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:r:H:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            width = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            rows = strtoul(optarg, NULL, 10);
+            break;
+        case 'H':
+            holebytes = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            image = optarg;
+            break;
+        default:
+            width = 0;
+        }
+    }
+    if (optind != argc - 1 || width == 0 || rows == 0)
+    {
+        fprintf(stderr, "usage: memory_heatmap [-w cells-per-row] [-r rows-per-chunk] [-H hole-bytes] [-o image.ppm] snapshot\n");
+        return 2;
+    }
+
+    snapname = argv[optind];
+    size_t size;
+    int8 *buf = readSnapshot(snapname, &size);
+    const int8 *p = buf + sizeof(struct s_snapshot), *end = buf + size;
+
+    const struct s_snapshot *head = (const struct s_snapshot *)buf;
+    if (size < sizeof(*head) || memcmp(head->magic, Snapshotmagic, sizeof(head->magic)) || head->version != Snapshotversion)
+    {
+        fprintf(stderr, "heatmap: %s is not a heap snapshot\n", snapname);
+        return 1;
+    }
+
+    word wordbytes = head->wordbytes;
+    word cells = width * rows;
+    cell *grid = NULL;  // Cells of every chunk, one chunk after another, for the image.
+    word chunks = 0;
+    int64 totalwords = 0, totalalloc = 0, totalfree = 0, totalhole = 0, largest = 0;
+
+    printf("legend: ' ' free  . : + * increasingly allocated  # allocated  x mostly holes (free blocks under %lu bytes)\n", holebytes);
+
+    for (int64 arena; (arena = getVarint(&p, end));)
+    {
+        int64 base = getVarint(&p, end);
+        int64 words = getVarint(&p, end);
+
+        grid = realloc(grid, (chunks + 1) * cells * sizeof(cell));
+        if (!grid)
+        {
+            fprintf(stderr, "heatmap: out of memory\n");
+            return 1;
+        }
+        cell *chunkcells = grid + chunks * cells;
+        memset(chunkcells, 0, cells * sizeof(cell));
+        double cellwords = words ? (double)words / cells : 1;
+
+        int64 offset = 0, alloced = 0, freewords = 0, holewords = 0, freeblocks = 0, maxfree = 0;
+        for (int64 run; (run = getVarint(&p, end));)
+        {
+            int64 runwords = run >> 1;
+            int64 blocks = getVarint(&p, end);
+            if (offset + runwords > words)
+                corrupt();
+
+            int32 kind = 0;
+            if (run & 1)
+                alloced += runwords;
+            else
+            {
+                bool hole = runwords * wordbytes < holebytes;
+                kind = hole ? 2 : 1;
+                *(hole ? &holewords : &freewords) += runwords;
+                freeblocks += blocks;
+                if (runwords > maxfree)
+                    maxfree = runwords;
+            }
+
+            spread(chunkcells, cells, cellwords, offset, runwords, kind);
+            offset += runwords;
+        }
+
+        int64 allfree = freewords + holewords;
+        printf("\narena %llu chunk %#llx: %llu KB, %.1f%% allocated, %llu free blocks, largest free %llu KB, fragmentation %.1f%%, holes %.1f%%\n",
+               arena - 1, base, words * wordbytes / 1024, words ? 100.0 * alloced / words : 0.0, freeblocks,
+               maxfree * wordbytes / 1024, allfree ? 100.0 * (1.0 - (double)maxfree / allfree) : 0.0,
+               allfree ? 100.0 * holewords / allfree : 0.0);
+
+        for (word r = 0; r < rows; r++)
+        {
+            putchar('|');
+            for (word c = 0; c < width; c++)
+                putchar(cellChar(&chunkcells[r * width + c]));
+            printf("|\n");
+        }
+
+        chunks++;
+        totalwords += words;
+        totalalloc += alloced;
+        totalfree += freewords;
+        totalhole += holewords;
+        if (maxfree > largest)
+            largest = maxfree;
+    }
+
+    int64 allfree = totalfree + totalhole;
+    printf("\nheap: %lu chunk(s), %llu KB, %.1f%% allocated, largest free %llu KB, fragmentation %.1f%%, holes %.1f%%\n", chunks,
+           totalwords * wordbytes / 1024, totalwords ? 100.0 * totalalloc / totalwords : 0.0, largest * wordbytes / 1024,
+           allfree ? 100.0 * (1.0 - (double)largest / allfree) : 0.0, allfree ? 100.0 * totalhole / allfree : 0.0);
+
+    // The image stacks the chunks' grids, separated by a black row.
+    if (image)
+    {
+        FILE *f = fopen(image, "wb");
+        if (!f)
+        {
+            perror(image);
+            return 1;
+        }
+
+        word height = chunks ? chunks * (rows + 1) - 1 : 0;
+        fprintf(f, "P6\n%lu %lu\n255\n", width, height);
+        for (word k = 0; k < chunks; k++)
+        {
+            if (k)
+            {
+                for (word c = 0; c < width; c++)
+                    fwrite("\0\0\0", 1, 3, f);
+            }
+
+            for (word i = 0; i < cells; i++)
+            {
+                const cell *c = &grid[k * cells + i];
+                double total = c->alloced + c->free + c->hole;
+                int8 rgb[3] = {0, 0, 0};
+                if (total > 0)
+                {
+                    rgb[0] = (int8)(255 * c->hole / total);
+                    rgb[1] = (int8)(255 * c->free / total);
+                    rgb[2] = (int8)(255 * c->alloced / total);
+                }
+                fwrite(rgb, 1, 3, f);
+            }
+        }
+        fclose(f);
+    }
+
+    free(grid);
+    free(buf);
+    return 0;
+}
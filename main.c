@@ -1,311 +1,3233 @@
 /*
  * Memory allocator with block splitting and proper initialization
- * This file contains the core logic for a simple first-fit memory allocator.
- * It manages a fixed-size heap defined in heap.asm.
+ * This file contains the core logic for a simple memory allocator.
+ * It manages a heap that starts as the fixed-size region defined in heap.asm and grows with chunks mapped from the OS.
+ * Free blocks are kept in segregated size-class lists so allocation does not need to walk the heap.
+ * The heap can be split into several independently locked arenas for multi-threaded use.
 */
 
 #include "main.h"
 
+#ifdef ALLOC_HARDEN
+#include <sys/random.h>
+#endif
+
+#if defined(ALLOC_HUGEPAGES) || defined(ALLOC_NUMA)
+#include <fcntl.h>
+#endif
+
+#ifdef ALLOC_NUMA
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
+
+// The arenas memspace is split into (see Arenas in main.h).
+// Each one owns its own block chain, free lists, next-fit cursor and lock.
+#ifdef ALLOC_THREADS
+arena arenas[Arenas] = {[0 ... Arenas - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}};
+#else
+arena arenas[Arenas];
+#endif
+
+// Block search policy used by alloc(). Chosen at build time with -DALLOC_POLICY and changed at runtime with setpolicy().
+// Shared by all arenas, so it is read and written atomically rather than under any one arena's lock.
+static int32 policy = ALLOC_POLICY;
+
+// Arena the calling thread allocates from; assigned round-robin on the thread's first allocation.
+static threadlocal arena *myarena;
+static int32 nextarena;
+
+// Registry of the chunks currently mapped from the OS, so a pointer outside memspace can be traced back to its chunk and arena.
+// Slots are reused after a chunk is unmapped. Lookups take the read side of the lock, so frees in different arenas do not serialize on it.
+static chunk *mapped[Maxchunks];
+
+#ifdef ALLOC_THREADS
+static pthread_rwlock_t mappedlock = PTHREAD_RWLOCK_INITIALIZER;
+#define rdlockmapped() pthread_rwlock_rdlock(&mappedlock)
+#define wrlockmapped() pthread_rwlock_wrlock(&mappedlock)
+#define unlockmapped() pthread_rwlock_unlock(&mappedlock)
+#else
+#define rdlockmapped() ((void)0)
+#define wrlockmapped() ((void)0)
+#define unlockmapped() ((void)0)
+#endif
+
+#ifdef ALLOC_STATS
+// Counters of the work a thread does without taking an arena lock: its thread cache and the blocks it maps directly.
+// Each thread only writes its own counters, and alloc_stats adds them all up. A block mapped by one thread and
+// unmapped by another leaves one counter up and the other down by the same amount, which the unsigned sum cancels out.
+struct s_threadstats
+{
+    size_t cachedbytes;
+    size_t cachedblocks;
+    size_t mappedbytes;
+    size_t mappedblocks;
+#ifdef ALLOC_THREADS
+    struct s_threadstats *next; // Next running thread that has counted anything.
+    struct s_threadstats *prev;
+    bool registered;            // Whether this thread is on the list.
+#endif
+};
+
+static threadlocal struct s_threadstats mystats;
+
+// Length of the block search in progress in this thread, for the search histogram.
+static threadlocal word probed;
+#define statProbe() (probed++)
+
+static void statsSum(struct s_threadstats *sum, struct s_threadstats *s)
+{
+    sum->cachedbytes += __atomic_load_n(&s->cachedbytes, __ATOMIC_RELAXED);
+    sum->cachedblocks += __atomic_load_n(&s->cachedblocks, __ATOMIC_RELAXED);
+    sum->mappedbytes += __atomic_load_n(&s->mappedbytes, __ATOMIC_RELAXED);
+    sum->mappedblocks += __atomic_load_n(&s->mappedblocks, __ATOMIC_RELAXED);
+}
+
+#ifdef ALLOC_THREADS
+static struct s_threadstats *statthreads;  // Running threads that have counted anything.
+static struct s_threadstats retired;       // Sum of the counters of the threads that have exited.
+static pthread_mutex_t statslock = PTHREAD_MUTEX_INITIALIZER; // Protects the two above; only taken by thread start and exit and alloc_stats.
+
+// Key whose destructor retires a thread's counters when it exits.
+static pthread_key_t statskey;
+static pthread_once_t statsonce = PTHREAD_ONCE_INIT;
+
+static void tcacheFlushAll(void *cache);
+
+/*
+ * Folds the counters of an exiting thread into `retired` and takes the thread off the list.
+ * Runs as the statskey destructor; the thread's cache is flushed first, as destructors run in no particular order.
+ */
+static void statsRetire(void *stats)
+{
+    struct s_threadstats *s = stats;
+
+    tcacheFlushAll(NULL);
+
+    pthread_mutex_lock(&statslock);
+    statsSum(&retired, s);
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        statthreads = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    pthread_mutex_unlock(&statslock);
+}
+
+static void statsKeyInit(void)
+{
+    pthread_key_create(&statskey, statsRetire);
+}
+
+// Puts the calling thread's counters on the list on its first counted event.
+static void statsRegister(void)
+{
+    pthread_once(&statsonce, statsKeyInit);
+    pthread_setspecific(statskey, &mystats);
+
+    pthread_mutex_lock(&statslock);
+    mystats.prev = NULL;
+    mystats.next = statthreads;
+    if (statthreads)
+        statthreads->prev = &mystats;
+    statthreads = &mystats;
+    mystats.registered = true;
+    pthread_mutex_unlock(&statslock);
+}
+#endif
+
+// Adds `n` (which may be a negative amount cast to size_t) to one of the calling thread's counters.
+// Only this thread writes it, so a plain read followed by an atomic store is enough; alloc_stats never sees a torn value.
+#ifdef ALLOC_THREADS
+#define statThread(field, n)                                                                 \
+    do                                                                                       \
+    {                                                                                        \
+        if (!mystats.registered)                                                             \
+            statsRegister();                                                                 \
+        __atomic_store_n(&mystats.field, mystats.field + (size_t)(n), __ATOMIC_RELAXED);     \
+    } while (0)
+#else
+#define statThread(field, n) (mystats.field += (size_t)(n))
+#endif
+#else
+#define statProbe() ((void)0)
+#define statThread(field, n) ((void)0)
+#endif
+
+#ifdef ALLOC_HARDEN
+/*
+ * Hardened mode: every header carries a checksum of its address, size and allocated bit (see s_header).
+ * The allocator seals a header whenever it changes one, and checks the seal on every free, realloc and allocation,
+ * so an overwritten header, a double free or a pointer the allocator never handed out is caught in O(1), without a heap walk.
+ * The prevfree bit is left out: neighbours update it in the headers of blocks they do not own.
+ */
+
+// Key of the checksum, picked at random when the first header is sealed, so the seals of a corrupted header cannot be forged.
+static word cookie;
+
+static word heapCookie(void)
+{
+    word c = __atomic_load_n(&cookie, __ATOMIC_RELAXED);
+    if (c)
+        return c;
+
+    // Without entropy this early, fall back on the stack and data addresses ASLR picked for this run.
+    if (getrandom(&c, sizeof(c), GRND_NONBLOCK) != (ssize_t)sizeof(c))
+        c = (word)(size_t)&c * 2654435761u ^ (word)(size_t)&cookie;
+    c |= 1; // 0 means no cookie yet.
+
+    // Threads racing here all settle on the cookie stored first.
+    word first = 0;
+    if (!__atomic_compare_exchange_n(&cookie, &first, c, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        c = first;
+    return c;
+}
+
+// Checksum of `hdr`: its keyed address and contents are multiplied by an odd constant, and the top Checkbits bits are kept.
+static inline word checkOf(header *hdr)
+{
+    word x = ((word)(size_t)hdr ^ heapCookie()) + ((word)hdr->w << 1 | hdr->alloced);
+    x *= (word)0x9e3779b97f4a7c15ull;
+    return x >> (Wordbits - Checkbits);
+}
+
+#define seal(hdr) ((hdr)->check = checkOf(hdr))
+#define sealed(hdr) ((hdr)->check == checkOf(hdr))
+#else
+#define seal(hdr) ((void)(hdr))
+#define sealed(hdr) ((void)(hdr), true)
+#endif
+
+// Returns the chunk of arena `a` that holds block `hdr`. Chunks grow geometrically, so an arena has only a handful of them to walk.
+static chunk *chunkIn(arena *a, header *hdr)
+{
+    chunk *c = &a->first;
+    while (c->next && !(hdr >= c->base && hdr < blockAt(c, c->words)))
+        c = c->next;
+    return c;
+}
+
+// Page maps of the arenas' slices of memspace, sized for the smallest page size (the last slice takes the rounding remainder).
+// A mapped chunk keeps its page map in the mapping, between its descriptor (and freemap) and its first block.
+static word slicepages[Arenas][pagemapBytes(Arenawords + Arenas, Minpage) / Wordbytes];
+
+/*
+ * Clears the bits of the pages of chunk `c` overlapping [from, to) in its page map, as that memory is about to be written.
+ * Released pages come back on their own when they are touched; the map only has to stop counting them as released.
+ */
+static void pagesUsed(chunk *c, char *from, char *to)
+{
+    if (!c->released || from >= to)
+        return;
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    word p = pageIn(c, from, page);
+    word n = pageIn(c, to - 1, page) - p + 1;
+
+    while (n)
+    {
+        word bit = p % Wordbits;
+        word k = Wordbits - bit < n ? Wordbits - bit : n;
+        word mask = (k == Wordbits ? ~(word)0 : ((word)1 << k) - 1) << bit;
+
+        c->released -= __builtin_popcountl(c->pagemap[p / Wordbits] & mask);
+        c->pagemap[p / Wordbits] &= ~mask;
+
+        p += k;
+        n -= k;
+    }
+}
+
+#ifdef ALLOC_FREEMAP
+// Freemaps of the arenas' slices of memspace (the last slice takes the rounding remainder, hence the spare words).
+// A mapped chunk keeps its freemap in the mapping, between its descriptor and its first block.
+static word slicemaps[Arenas][mapBytes(Arenawords) / Wordbytes + 1];
+
+/*
+ * Marks the `words` words starting `off` words into chunk `c` as free (`free` set) or allocated in its freemap.
+ * Sizes and offsets are whole granules, so this sets or clears a run of bits, a word at a time.
+ */
+static void mapMark(chunk *c, word off, word words, bool free)
+{
+    word g = off / Alignwords;
+    word n = words / Alignwords;
+
+    while (n)
+    {
+        word bit = g % Wordbits;
+        word k = Wordbits - bit < n ? Wordbits - bit : n;
+        word mask = (k == Wordbits ? ~(word)0 : ((word)1 << k) - 1) << bit;
+
+        if (free)
+            c->freemap[g / Wordbits] |= mask;
+        else
+            c->freemap[g / Wordbits] &= ~mask;
+
+        g += k;
+        n -= k;
+    }
+}
+
+// Marks the `words` words of block `hdr` of arena `a` from its header on as free or allocated.
+#define mapBlock(a, hdr, words, free)                                \
+    do                                                               \
+    {                                                                \
+        chunk *c_ = chunkIn((a), (hdr));                             \
+        mapMark(c_, offsetIn(c_, (hdr)), (words), (free));           \
+    } while (0)
+
+/*
+ * Returns the first granule at or after `g` (and before `limit`) whose freemap bit in `map` is `set`, or `limit` if none is.
+ * Words whose bits are all the other way are skipped whole.
+ */
+static word mapNext(const word *map, word g, word limit, bool set)
+{
+    while (g < limit)
+    {
+        word x = set ? map[g / Wordbits] : ~map[g / Wordbits];
+        x &= ~(word)0 << (g % Wordbits);
+        if (x)
+        {
+            g = g / Wordbits * Wordbits + __builtin_ctzl(x);
+            return g < limit ? g : limit;
+        }
+        g = (g / Wordbits + 1) * Wordbits;
+    }
+    return limit;
+}
+
+/*
+ * Finds the first free block of at least `total_size` words (data + header) in chunk `c` from its freemap, for FitMap.
+ * Each run of set bits is one free block, so the search hops from run to run without reading any header.
+ * Returns its header, or NULL if no free block of the chunk is large enough.
+ */
+static header *mapFind(chunk *c, word total_size)
+{
+    word need = (total_size + Alignwords - 1) / Alignwords;
+    word granules = c->words / Alignwords;
+
+    for (word g = mapNext(c->freemap, 0, granules, true); g < granules;)
+    {
+        statProbe();
+        word end = mapNext(c->freemap, g, granules, false);
+        if (end - g >= need)
+            return blockAt(c, g * Alignwords);
+        g = mapNext(c->freemap, end, granules, true);
+    }
+
+    return NULL;
+}
+#else
+#define mapMark(c, off, words, free) ((void)0)
+#define mapBlock(a, hdr, words, free) ((void)0)
+#endif
+
+/*
+ * Returns the chunk containing the block header `hdr`, or NULL if `hdr` is not inside any part of the heap.
+ * Arenas are equal slices of memspace, so memspace pointers need only address-range math; mapped chunks are looked up in the registry.
+ */
+chunk *chunkOf(header *hdr)
+{
+    chunk *c = NULL;
+
+    if (hdr >= (header *)memspace && hdr < (header *)(memspace + Maxwords * Wordbytes))
+    {
+        word i = ((char *)hdr - (char *)memspace) / Wordbytes / Arenawords;
+        c = &arenas[i < Arenas ? i : Arenas - 1].first;
+
+        // An arena that has never been used has no blocks yet.
+        return c->base && hdr >= c->base && hdr < blockAt(c, c->words) ? c : NULL;
+    }
+
+    rdlockmapped();
+    for (word n = 0; n < Maxchunks; n++)
+    {
+        chunk *m = mapped[n];
+        if (m && hdr >= m->base && hdr < blockAt(m, m->words))
+        {
+            c = m;
+            break;
+        }
+    }
+    unlockmapped();
+
+    return c;
+}
+
+/*
+ * Returns the arena that owns the heap block with header `hdr`.
+ * Pointers that are not in the heap map to the first arena; freealloc_ rejects them anyway.
+ */
+arena *arenaOf(header *hdr)
+{
+    chunk *c = chunkOf(hdr);
+    return c ? c->owner : &arenas[0];
+}
+
+#ifdef ALLOC_NUMA
+/*
+ * NUMA placement: arena i belongs to node i % numaNodes(), and the memory of its slice and of every chunk it maps is
+ * bound to that node before anything touches it, so it does not land wherever the first thread to use it happens to run.
+ * Threads allocate from an arena of the node they are running on.
+ */
+
+// Calls of threadArena by this thread since it last checked which node it runs on.
+static threadlocal int32 arenacalls;
+
+/*
+ * Returns the number of memory nodes of the machine, read once from sysfs (1 if that fails).
+ * The setting is read with plain system calls, as stdio may allocate.
+ */
+static word numaNodes(void)
+{
+    static word nodes;
+
+    if (!nodes)
+    {
+        // The file lists the possible nodes as ranges, e.g. "0" or "0-3,5"; the largest number is the highest node.
+        char buf[256] = {0};
+        int fd = open("/sys/devices/system/node/possible", O_RDONLY);
+        if (fd >= 0)
+        {
+            if (read(fd, buf, sizeof(buf) - 1) < 0)
+                buf[0] = 0;
+            close(fd);
+        }
+
+        word n = 1;
+        for (char *p = buf; *p; p++)
+        {
+            if (*p >= '0' && *p <= '9')
+            {
+                word node = strtoul(p, &p, 10);
+                if (node + 1 > n)
+                    n = node + 1;
+                p--;
+            }
+        }
+        __atomic_store_n(&nodes, n, __ATOMIC_RELAXED);
+    }
+
+    return nodes;
+}
+
+// Node that arena `a` keeps its memory on.
+#define arenaNode(a) ((word)((a) - arenas) % numaNodes())
+
+/*
+ * Returns the node the calling thread is running on (0 if the kernel does not say).
+ */
+static word currentNode(void)
+{
+    unsigned cpu, node;
+    return syscall(SYS_getcpu, &cpu, &node, NULL) ? 0 : node;
+}
+
+/*
+ * Returns an arena of `node`, taking the node's arenas round-robin. With fewer arenas than nodes, nodes share them.
+ */
+static arena *nodeArena(word node)
+{
+    word nodes = numaNodes();
+    word count = node < Arenas ? (Arenas - node + nodes - 1) / nodes : 0;
+    if (!count)
+        return &arenas[node % Arenas];
+
+    return &arenas[node + __atomic_fetch_add(&nextarena, 1, __ATOMIC_RELAXED) % count * nodes];
+}
+
+/*
+ * Sets the memory policy of the pages in [addr, addr + bytes) to prefer `node`, moving any page already touched.
+ * Preferring rather than binding lets an exhausted node spill over to the others instead of failing the page fault.
+ * The partial pages at either end are left alone, as they may belong to a neighbouring arena.
+ */
+static void numaBind(void *addr, size_t bytes, word node)
+{
+    static bool warned;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = ((size_t)addr + page - 1) & ~(page - 1);
+    size_t end = ((size_t)addr + bytes) & ~(page - 1);
+    word mask = (word)1 << node;
+
+    if (end <= start || node >= Wordbits || numaNodes() < 2)
+        return;
+
+    if (syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, &mask, (unsigned long)Wordbits + 1, MPOL_MF_MOVE) &&
+        !__atomic_exchange_n(&warned, true, __ATOMIC_RELAXED))
+        trace(TraceErr, "alloc: Warning: mbind to node %lu failed (errno %d); memory is placed where it is first touched.\n", node, errno);
+}
+#else
+#define numaNodes() ((word)1)
+#define arenaNode(a) ((void)(a), (word)0)
+#define nodeArena(node) threadArena()
+#define numaBind(addr, bytes, node) ((void)(addr), (void)(bytes), (void)(node))
+#endif
+
+#ifdef ALLOC_THREADS
+// Key whose destructor drains the remote stack of a thread's arena when the thread exits, as no thread may allocate from it again.
+static pthread_key_t arenakey;
+static pthread_once_t arenaonce = PTHREAD_ONCE_INIT;
+
+static void arenaLeave(void *key unused)
+{
+    lockarena(myarena);
+    remoteDrain_(myarena);
+    unlockarena(myarena);
+}
+
+static void arenaKeyInit(void)
+{
+    pthread_key_create(&arenakey, arenaLeave);
+}
+
+// Registers the calling thread's arena for arenaLeave once it has one; any allocation this makes finds the arena already set.
+static void arenaJoin(void)
+{
+    pthread_once(&arenaonce, arenaKeyInit);
+    pthread_setspecific(arenakey, &myarena);
+}
+#else
+#define arenaJoin() ((void)0)
+#endif
+
+/*
+ * Returns the arena the calling thread allocates from, assigning one round-robin on first use.
+ * With NUMA placement it is an arena of the thread's node, checked again every Numarecheck calls in case the thread moved.
+ */
+arena *threadArena(void)
+{
+#ifdef ALLOC_NUMA
+    if (!myarena || ++arenacalls % Numarecheck == 0)
+    {
+        bool first = !myarena;
+        word node = currentNode();
+        if (!myarena || arenaNode(myarena) != node % numaNodes())
+            myarena = nodeArena(node);
+        if (first)
+            arenaJoin();
+    }
+#else
+    if (!myarena)
+    {
+        myarena = &arenas[__atomic_fetch_add(&nextarena, 1, __ATOMIC_RELAXED) % Arenas];
+        arenaJoin();
+    }
+#endif
+
+    return myarena;
+}
+
+#ifdef ALLOC_THREADS
+/*
+ * Fork handlers (see pthread_atfork). forkPrepare takes every lock of the allocator, in the order the allocator nests them,
+ * so no other thread is halfway through changing the heap when the process forks. The parent then releases them again,
+ * and the child, which only has the forking thread left, starts from fresh locks.
+ */
+void forkPrepare(void)
+{
+    for (word i = 0; i < Arenas; i++)
+        lockarena(&arenas[i]);
+    wrlockmapped();
+#ifdef ALLOC_STATS
+    pthread_mutex_lock(&statslock);
+#endif
+}
+
+void forkParent(void)
+{
+#ifdef ALLOC_STATS
+    pthread_mutex_unlock(&statslock);
+#endif
+    unlockmapped();
+    for (word i = Arenas; i-- > 0;)
+        unlockarena(&arenas[i]);
+}
+
+// A lock cannot be unlocked by a thread other than the one that took it, and the child's thread has a new id.
+void forkChild(void)
+{
+#ifdef ALLOC_STATS
+    pthread_mutex_init(&statslock, NULL);
+#endif
+    pthread_rwlock_init(&mappedlock, NULL);
+    for (word i = 0; i < Arenas; i++)
+        pthread_mutex_init(&arenas[i].lock, NULL);
+}
+#endif
+
+#ifdef ALLOC_HUGEPAGES
+/*
+ * Reports once that the heap runs on normal pages, `why` saying which hugepages were not available.
+ */
+static void hugeWarn(const char *why)
+{
+    static bool warned;
+
+    if (!__atomic_exchange_n(&warned, true, __ATOMIC_RELAXED))
+        trace(TraceErr, "alloc: Warning: %s; the heap falls back to normal pages.\n", why);
+}
+
+/*
+ * Returns whether the kernel may back memory advised with MADV_HUGEPAGE by transparent hugepages, reading its setting once.
+ * The setting is read with plain system calls, as stdio may allocate and this can run with an arena locked.
+ */
+static bool hugeEnabled(void)
+{
+    static int32 enabled; // 0 until read, then 1 if enabled and 2 if not.
+
+    if (!enabled)
+    {
+        char buf[64] = {0};
+        int fd = open("/sys/kernel/mm/transparent_hugepage/enabled", O_RDONLY);
+        if (fd >= 0)
+        {
+            read(fd, buf, sizeof(buf) - 1);
+            close(fd);
+        }
+        __atomic_store_n(&enabled, buf[0] && !strstr(buf, "[never]") ? 1 : 2, __ATOMIC_RELAXED);
+    }
+
+    return enabled == 1;
+}
+
+/*
+ * Advises the kernel to back the whole hugepages inside [from, to) with transparent hugepages.
+ */
+static void hugeAdvise(char *from, char *to)
+{
+    char *start = (char *)(((size_t)from + Hugepage - 1) & ~(Hugepage - 1));
+    char *end = (char *)((size_t)to & ~(Hugepage - 1));
+
+    if (end <= start)
+        return;
+    if (!hugeEnabled() || madvise(start, end - start, MADV_HUGEPAGE))
+        hugeWarn("Transparent hugepages are disabled");
+}
+
+/*
+ * Maps `bytes` bytes starting on a hugepage boundary and backed by hugepages where the system has them.
+ * If `hugetlb` is not NULL, `bytes` is whole hugepages and ALLOC_HUGEPAGES is 2, explicit hugepages are tried first,
+ * and `*hugetlb` tells whether they were used.
+ * Otherwise the mapping is an ordinary one, cut out of a larger one at the boundary and advised for transparent hugepages.
+ * Returns MAP_FAILED if not even normal pages could be mapped.
+ */
+static void *hugeMap(size_t bytes, bool *hugetlb)
+{
+    if (hugetlb)
+        *hugetlb = false;
+
+#if ALLOC_HUGEPAGES >= 2
+    if (hugetlb && !(bytes & (Hugepage - 1)))
+    {
+        void *map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (map != MAP_FAILED)
+        {
+            *hugetlb = true;
+            return map;
+        }
+        trace(TraceOps, "alloc: No explicit hugepages for %zu bytes; trying transparent ones.\n", bytes);
+    }
+#endif
+
+    // Map a hugepage more than needed, then unmap what lies before the first boundary and after the end.
+    char *raw = mmap(NULL, bytes + Hugepage, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    char *map = (char *)(((size_t)raw + Hugepage - 1) & ~(Hugepage - 1));
+    if (map > raw)
+        munmap(raw, map - raw);
+    if (raw + Hugepage > map)
+        munmap(map + bytes, raw + Hugepage - map);
+
+    hugeAdvise(map, map + bytes);
+    return map;
+}
+#endif
+
+/*
+ * Maps a new chunk for arena `a` that can hold a block of `words_to_alloc` data words, and links it after the arena's last chunk.
+ * Chunks grow geometrically: each new one is at least as large as everything the arena already has, so a heap of size S needs only O(log S) chunks.
+ * The whole chunk becomes one free block on the arena's free lists.
+ * Returns its header, or NULL if the request is too large for a block or the OS refuses the mapping.
+ */
+header *chunkGrow(arena *a, word words_to_alloc)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    word maxwords = Maxblockwords & ~(Alignwords - 1);
+    word need = alignWords(words_to_alloc + 1);
+    word grow = a->words > need ? a->words : need;
+
+    if (need > maxwords || need >= (size_t)-1 / 2 / Wordbytes)
+        return NULL;
+    if (grow > maxwords)
+        grow = maxwords;
+
+    // The first header follows the descriptor, moved up so its payload is aligned (the mapping itself is page-aligned).
+    // Room for that, the blocks and the epilogue header is rounded up to whole pages, or whole hugepages with ALLOC_HUGEPAGES.
+    // Whatever the rounding adds goes to the blocks as long as it still fits in a block.
+    // The page map and the freemap sit between the descriptor and the first header, sized for every word the rounding can add.
+    size_t round = page;
+#ifdef ALLOC_HUGEPAGES
+    round = Hugepage;
+#endif
+    size_t pagemap = pagemapBytes((size_t)grow + 1 + round / Wordbytes, page);
+    size_t freemap = 0;
+#ifdef ALLOC_FREEMAP
+    freemap = mapBytes((size_t)grow + 1 + round / Wordbytes);
+#endif
+    size_t head = (size_t)alignHeader(sizeof(chunk) + freemap + pagemap);
+    size_t bytes = (head + ((size_t)grow + 1) * Wordbytes + round - 1) & ~(round - 1);
+    size_t words = ((bytes - head) / Wordbytes - 1) & ~(size_t)(Alignwords - 1);
+    if (words > maxwords)
+        words = maxwords;
+
+#ifdef ALLOC_HUGEPAGES
+    bool hugetlb;
+    void *map = hugeMap(bytes, &hugetlb);
+#else
+    void *map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#endif
+    if (map == MAP_FAILED)
+    {
+        trace(TraceOps, "alloc: mmap of a %zu-byte chunk failed.\n", bytes);
+        return NULL;
+    }
+
+    numaBind(map, bytes, arenaNode(a));
+
+    chunk *c = map;
+#ifdef ALLOC_HUGEPAGES
+    c->hugetlb = hugetlb;
+#endif
+    c->base = (header *)((char *)map + head);
+    c->words = words;
+    c->bytes = bytes;
+    c->owner = a;
+    c->clean = (char *)(nodeof(c->base) + 1); // Only the first block's header, tree node and footer will have been written.
+#ifdef ALLOC_FREEMAP
+    c->freemap = (word *)(c + 1);
+#endif
+    c->pagemap = (word *)((char *)(c + 1) + freemap);
+
+    wrlockmapped();
+    word n = 0;
+    while (n < Maxchunks && mapped[n])
+        n++;
+    if (n < Maxchunks)
+        mapped[n] = c;
+    unlockmapped();
+
+    if (n == Maxchunks)
+    {
+        trace(TraceErr, "alloc: Error: Chunk registry is full (%d chunks). Cannot grow the heap.\n", Maxchunks);
+        munmap(map, bytes);
+        return NULL;
+    }
+
+    c->prev = a->tail;
+    c->next = NULL;
+    a->tail->next = c;
+    a->tail = c;
+    a->words += c->words;
+
+    // The fresh mapping is zero-filled, so the epilogue (w = 0) only needs its alloced bit.
+    header *hdr = c->base;
+    hdr->w = c->words;
+    hdr->alloced = false;
+    blockAt(c, c->words)->alloced = true;
+    binInsert(a, hdr);
+    tagBoundary(hdr);
+    mapMark(c, 0, c->words, true);
+
+    trace(TraceAll, "alloc: Mapped new chunk at %p for arena %lu: %lu words of blocks.\n", (void *)c, (word)(a - arenas), c->words);
+    return hdr;
+}
+
+// A chunk is fully free when its first block is free and spans the whole chunk.
+#define chunkIsFree(c) (!(c)->base->alloced && (c)->base->w == (c)->words)
+
+/*
+ * Returns fully free chunks at the tail of arena `a` to the OS.
+ * One free chunk is always kept at the tail (the memspace slice counts), so an allocation that crosses a chunk boundary
+ * back and forth does not map and unmap a chunk on every call.
+ */
+void chunkTrim(arena *a)
+{
+    chunk *c = a->tail;
+
+    while (c->prev && chunkIsFree(c) && chunkIsFree(c->prev))
+    {
+        // The chunk's only block leaves the free lists with it, as does any cursor that pointed into it.
+        binRemove(a, c->base);
+        if (a->roverchunk == c)
+        {
+            a->rover = NULL;
+            a->roverchunk = NULL;
+        }
+
+        a->tail = c->prev;
+        a->tail->next = NULL;
+        a->words -= c->words;
+
+        wrlockmapped();
+        for (word n = 0; n < Maxchunks; n++)
+        {
+            if (mapped[n] == c)
+                mapped[n] = NULL;
+        }
+        unlockmapped();
+
+        trace(TraceAll, "free: Returning chunk at %p (%lu words) to the OS.\n", (void *)c, c->words);
+        munmap(c, c->bytes);
+
+        c = a->tail;
+    }
+}
+
+/*
+ * Returns the bin index for a block of `w` words: floor(log2(w)).
+ * `w` is always at least 1 for a valid block.
+ */
+word binIndex(word w)
+{
+    return Wordbits - 1 - __builtin_clzl(w);
+}
+
+// Whether free block `x` comes before `y` in the size tree: smaller blocks first, and blocks of the same size by address.
+#define treeBefore(x, y) ((x)->w < (y)->w || ((x)->w == (y)->w && (x) < (y)))
+
+// Whether tree block `hdr` is red; missing children count as black.
+#define treeRed(hdr) ((hdr) && nodeof(hdr)->red)
+
+// Returns the slot that points at tree block `hdr`: its parent's child pointer, or the arena's root.
+static header **treeLink(arena *a, header *hdr)
+{
+    header *parent = nodeof(hdr)->parent;
+    if (!parent)
+        return &a->tree;
+    return &nodeof(parent)->child[nodeof(parent)->child[1] == hdr];
+}
+
+/*
+ * Rotates tree block `x` down towards side `dir` (0 for a left rotation, 1 for a right one);
+ * its child on the other side takes its place.
+ */
+static void treeRotate(arena *a, header *x, int dir)
+{
+    node *xn = nodeof(x);
+    header *y = xn->child[!dir];
+    node *yn = nodeof(y);
+
+    xn->child[!dir] = yn->child[dir];
+    if (yn->child[dir])
+        nodeof(yn->child[dir])->parent = x;
+
+    *treeLink(a, x) = y;
+    yn->parent = xn->parent;
+    yn->child[dir] = x;
+    xn->parent = y;
+}
+
+/*
+ * Adds free block `hdr` to the size tree of arena `a` and rebalances it.
+ */
+static void treeInsert(arena *a, header *hdr)
+{
+    header *parent = NULL;
+    header **link = &a->tree;
+    while (*link)
+    {
+        parent = *link;
+        link = &nodeof(parent)->child[!treeBefore(hdr, parent)];
+    }
+
+    node *n = nodeof(hdr);
+    n->child[0] = NULL;
+    n->child[1] = NULL;
+    n->parent = parent;
+    n->red = 1;
+    *link = hdr;
+
+    // A red node may not have a red parent: recolour while the uncle is red, otherwise rotate the red pair into place.
+    while (treeRed(nodeof(hdr)->parent))
+    {
+        header *p = nodeof(hdr)->parent;
+        header *g = nodeof(p)->parent; // The root is black, so a red parent has a parent of its own.
+        int dir = nodeof(g)->child[1] == p;
+        header *uncle = nodeof(g)->child[!dir];
+
+        if (treeRed(uncle))
+        {
+            nodeof(p)->red = 0;
+            nodeof(uncle)->red = 0;
+            nodeof(g)->red = 1;
+            hdr = g;
+            continue;
+        }
+
+        if (nodeof(p)->child[!dir] == hdr)
+        {
+            hdr = p;
+            treeRotate(a, hdr, dir);
+            p = nodeof(hdr)->parent;
+        }
+
+        nodeof(p)->red = 0;
+        nodeof(g)->red = 1;
+        treeRotate(a, g, !dir);
+    }
+
+    nodeof(a->tree)->red = 0;
+}
+
+// Puts tree block `v` (possibly NULL) where tree block `u` is, as seen from `u`'s parent.
+static void treeReplace(arena *a, header *u, header *v)
+{
+    *treeLink(a, u) = v;
+    if (v)
+        nodeof(v)->parent = nodeof(u)->parent;
+}
+
+/*
+ * Takes free block `hdr` out of the size tree of arena `a` and rebalances it.
+ */
+static void treeRemove(arena *a, header *hdr)
+{
+    node *n = nodeof(hdr);
+    header *x, *parent;
+    word red = n->red;
+
+    if (!n->child[0] || !n->child[1])
+    {
+        x = n->child[0] ? n->child[0] : n->child[1];
+        parent = n->parent;
+        treeReplace(a, hdr, x);
+    }
+    else
+    {
+        // Two children: the next block in order (which has no left child) takes this one's place and colour.
+        header *y = n->child[1];
+        while (nodeof(y)->child[0])
+            y = nodeof(y)->child[0];
+
+        node *yn = nodeof(y);
+        red = yn->red;
+        x = yn->child[1];
+        if (yn->parent == hdr)
+            parent = y;
+        else
+        {
+            parent = yn->parent;
+            treeReplace(a, y, x);
+            yn->child[1] = n->child[1];
+            nodeof(yn->child[1])->parent = y;
+        }
+
+        treeReplace(a, hdr, y);
+        yn->child[0] = n->child[0];
+        nodeof(yn->child[0])->parent = y;
+        yn->red = n->red;
+    }
+
+    if (red)
+        return;
+
+    // A black node is gone, so the path through `x` is one black short until a red node or a rotation makes up for it.
+    while (x != a->tree && !treeRed(x))
+    {
+        node *p = nodeof(parent);
+        int dir = p->child[1] == x;
+        header *sibling = p->child[!dir]; // Never NULL: the other side still has the black node this side lost.
+
+        if (treeRed(sibling))
+        {
+            nodeof(sibling)->red = 0;
+            p->red = 1;
+            treeRotate(a, parent, dir);
+            sibling = p->child[!dir];
+        }
+
+        node *s = nodeof(sibling);
+        if (!treeRed(s->child[0]) && !treeRed(s->child[1]))
+        {
+            s->red = 1;
+            x = parent;
+            parent = p->parent;
+            continue;
+        }
+
+        if (!treeRed(s->child[!dir]))
+        {
+            nodeof(s->child[dir])->red = 0;
+            s->red = 1;
+            treeRotate(a, sibling, !dir);
+            sibling = p->child[!dir];
+            s = nodeof(sibling);
+        }
+
+        s->red = p->red;
+        p->red = 0;
+        nodeof(s->child[!dir])->red = 0;
+        treeRotate(a, parent, dir);
+        x = a->tree;
+    }
+
+    if (x)
+        nodeof(x)->red = 0;
+}
+
+/*
+ * Returns the smallest block of at least `total_size` words in the size tree of arena `a` (the lowest such block
+ * in address order among equal sizes), or NULL if there is none. Visits one block per level of the tree.
+ */
+static header *treeFind(arena *a, word total_size)
+{
+    header *best = NULL;
+
+    for (header *hdr = a->tree; hdr;)
+    {
+        statProbe();
+        if (hdr->w >= total_size)
+        {
+            best = hdr;
+            hdr = nodeof(hdr)->child[0];
+        }
+        else
+            hdr = nodeof(hdr)->child[1];
+    }
+
+    return best;
+}
+
+/*
+ * Inserts a free block at the head of the bin for its size in arena `a`, or into its size tree if it is too large for the bins.
+ * The links (or tree node) are written into the block's (unused) data area.
+ */
+void binInsert(arena *a, header *hdr)
+{
+    statAdd(a, freebytes, hdr->w * Wordbytes);
+    statAdd(a, freeblocks, 1);
+
+    if (hdr->w >= Treewords)
+    {
+        treeInsert(a, hdr);
+        return;
+    }
+
+    word k = binIndex(hdr->w);
+    links *l = linksof(hdr);
+
+    l->prev = NULL;
+    l->next = a->bins[k];
+    if (a->bins[k])
+        linksof(a->bins[k])->prev = hdr;
+
+    a->bins[k] = hdr;
+    a->binmap |= (word)1 << k;
+}
+
+/*
+ * Unlinks a free block from its bin (or the size tree) in arena `a`.
+ * Must be called with the block's size unchanged since it was inserted, so we find the same bin.
+ */
+void binRemove(arena *a, header *hdr)
+{
+    statAdd(a, freebytes, -(hdr->w * Wordbytes));
+    statAdd(a, freeblocks, -1);
+
+    if (hdr->w >= Treewords)
+    {
+        treeRemove(a, hdr);
+        return;
+    }
+
+    word k = binIndex(hdr->w);
+    links *l = linksof(hdr);
+
+    if (l->prev)
+        linksof(l->prev)->next = l->next;
+    else
+        a->bins[k] = l->next;
+
+    if (l->next)
+        linksof(l->next)->prev = l->prev;
+
+    if (!a->bins[k])
+        a->binmap &= ~((word)1 << k);
+}
+
+/*
+ * Finds a free block of at least `total_size` words (data + header) in arena `a`.
+ * Only the bin matching the request can hold blocks that are too small, so that is the only list we scan.
+ * Every block in a higher bin is large enough, so we take the head of the first populated one.
+ * Requests too large for the bins, and small ones no bin can serve, get their best fit from the size tree.
+ * Returns NULL if no free block is large enough.
+ */
+header *binFind(arena *a, word total_size)
+{
+    if (total_size >= Treewords)
+        return treeFind(a, total_size);
+
+    word k = binIndex(total_size);
+
+    for (header *hdr = a->bins[k]; hdr; hdr = linksof(hdr)->next)
+    {
+        statProbe();
+        if (hdr->w >= total_size)
+            return hdr;
+    }
+
+    // Mask off bins k and below; k + 1 <= Bins < Wordbits so the shift is well defined.
+    word larger = a->binmap & (~(word)0 << (k + 1));
+    if (!larger)
+        return treeFind(a, total_size);
+
+    statProbe();
+    return a->bins[__builtin_ctzl(larger)];
+}
+
+/*
+ * Finds the smallest free block of at least `total_size` words (data + header) in arena `a`, for FitBest.
+ * The bin matching the request is scanned for its best fit, stopping at an exact fit; failing that, the smallest block of
+ * the first populated higher bin is the best fit, as every block beyond it is larger still. Large requests go to the size tree.
+ * Returns NULL if no free block is large enough.
+ */
+header *binBest(arena *a, word total_size)
+{
+    if (total_size >= Treewords)
+        return treeFind(a, total_size);
+
+    word k = binIndex(total_size);
+    header *best = NULL;
+
+    for (header *hdr = a->bins[k]; hdr && !(best && best->w == total_size); hdr = linksof(hdr)->next)
+    {
+        statProbe();
+        if (hdr->w >= total_size && (!best || hdr->w < best->w))
+            best = hdr;
+    }
+    if (best)
+        return best;
+
+    word larger = a->binmap & (~(word)0 << (k + 1));
+    if (!larger)
+        return treeFind(a, total_size);
+
+    for (header *hdr = a->bins[__builtin_ctzl(larger)]; hdr; hdr = linksof(hdr)->next)
+    {
+        statProbe();
+        if (!best || hdr->w < best->w)
+            best = hdr;
+    }
+    return best;
+}
+
+/*
+ * Updates the boundary tags around `hdr` after its size or allocation state changed.
+ * A free block gets a footer (its size in its last word) so the block after it can locate its header in O(1).
+ * The block after `hdr` has its prevfree bit set to whether `hdr` is free.
+ * The last block of an arena is followed by the arena's epilogue header, so there is always a successor to update.
+ * In hardened mode `hdr` is sealed again, which covers almost every header change, as each one ends here.
+ */
+void tagBoundary(header *hdr)
+{
+    seal(hdr);
+    if (!hdr->alloced)
+        ((word *)hdr)[hdr->w - 1] = hdr->w;
+
+    ((header *)((char *)hdr + hdr->w * Wordbytes))->prevfree = !hdr->alloced;
+}
+
+static void coalesce_(chunk *c, header *hdr);
+#ifdef ALLOC_DEFER
+static bool fastFree_(arena *a, header *hdr);
+static bool fastParked_(arena *a, header *hdr);
+#else
+#define fastConsolidate_(a) ((void)(a), false)
+#define fastParked_(a, hdr) ((void)(a), (void)(hdr), false)
+#endif
+
+/*
+ * Frees a block of memory previously allocated by alloc(), straight back into the shared heap.
+ * Takes a pointer `ptr` to the data part of the allocated block.
+ * In thread-safe builds the caller must hold the owning arena's lock; use freealloc() for the public entry point.
+ * Includes basic validation checks, then hands the block to coalesce_.
+ * With deferred coalescing small blocks go to a fast bin instead, and are only coalesced when the arena consolidates.
+ */
+void freealloc_(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        // Standard C behavior: calling free(NULL) has no effect.
+        trace(TraceAll, "free: Called with NULL pointer. Doing nothing.\n");
+        return;
+    }
+
+    trace(TraceOps, "free: Attempting to free pointer %p\n", ptr);
+
+    // Calculate the address of the block header.
+    // The header is always located immediately before the data pointer returned by alloc.
+    // By casting the void pointer to a header pointer and subtracting 1,
+    // pointer arithmetic moves back by sizeof(header) bytes.
+    header *hdr = (header *)ptr - 1;
+
+    // --- Basic Validation Checks ---
+    // These checks help prevent crashes or heap corruption from invalid free calls.
+    // Check if the calculated header address is within one of the heap's chunks (the memspace slices or a mapped chunk).
+    chunk *c = chunkOf(hdr);
+    if (!c)
+    {
+        trace(TraceErr, "free: Error: Invalid pointer %p (calculated header %p) - outside heap bounds.\n", ptr, hdr);
+        // In a real system, this might abort or log a critical error.
+        // We'll print and return for now.
+        return;
+    }
+
+    // In hardened mode the header must carry the seal the allocator gave it; anything else was overwritten or never allocated.
+    if (!sealed(hdr))
+        fatal("free: Error: Pointer %p (header %p) has a corrupted header.\n", ptr, hdr);
+
+    // Check if the block is currently marked as allocated.
+    // Freeing a block that is already free (double-free) is an error.
+    if (!hdr->alloced)
+    {
+        trace(TraceErr, "free: Error: Pointer %p (header %p) is already free.\n", ptr, hdr);
+        // Again, might abort or log in a real system.
+        return;
+    }
+
+    // Check for a zero-sized block being freed. While unlikely with current alloc,
+    // it's a safety check against corruption. A valid header should have w >= 1.
+    if (hdr->w == 0)
+    {
+        trace(TraceErr, "free: Error: Pointer %p (header %p) has a zero size header. Heap possibly corrupted.\n", ptr, hdr);
+        return;
+    }
+
+#ifdef ALLOC_DEFER
+    if (fastFree_(c->owner, hdr))
+        return;
+#endif
+
+    coalesce_(c, hdr);
+}
+
+/*
+ * Marks the allocated block `hdr` of chunk `c` as free.
+ * Coalesces with the previous and next blocks if they are free, then puts the result on its size-class free list.
+ * The caller must hold the lock of the chunk's arena, and has validated the block.
+ */
+static void coalesce_(chunk *c, header *hdr)
+{
+    void *ptr = hdr + 1;
+
+    // Every block belongs to exactly one chunk of one arena, and it only ever merges with blocks of that chunk.
+    arena *a = c->owner;
+
+    // Calculate the offset of the header from the start of its chunk.
+    word hdr_offfset = offsetIn(c, hdr);
+
+    statAdd(a, allocbytes, -(hdr->w * Wordbytes));
+    statAdd(a, allocblocks, -1);
+
+    // --- Mark the block as free ---
+    hdr->alloced = false;
+    mapMark(c, hdr_offfset, hdr->w, true); // Its free neighbours are marked already.
+    trace(TraceAll, "free: Marked block at %p (header %p, size %lu words) as free.\n", ptr, hdr, (word)hdr->w);
+
+    // --- Coalescing (Merging with the previous block) ---
+    // The prevfree bit tells us whether the block just before this one is free.
+    // If it is, that block's footer (the word right before our header) holds its size, so we can find its header without walking the heap from memspace.
+    if (hdr->prevfree)
+    {
+        word prev_size = ((word *)hdr)[-1];
+        header *prev = (header *)((char *)hdr - prev_size * Wordbytes);
+
+        // The footer must agree with the header it points at, otherwise the heap is corrupted and merging would make it worse.
+        if (prev_size > 0 && prev_size <= hdr_offfset && !prev->alloced && prev->w == prev_size)
+        {
+            if (!sealed(prev))
+                fatal("free: Error: Free block at %p before %p has a corrupted header.\n", prev, hdr);
+
+            trace(TraceAll, "free: Coalescing with previous free block at %p (size %lu words).\n", prev, (word)prev->w);
+
+            // The previous block grows to cover this one, so it has to leave the bin for its old size.
+            binRemove(a, prev);
+            if (a->rover == hdr)
+                a->rover = prev;
+            prev->w += hdr->w;
+            hdr = prev;
+            statAdd(a, coalesces, 1);
+            hdr_offfset -= prev_size;
+            trace(TraceAll, "free: Merged block size is now %lu words.\n", (word)hdr->w);
+        }
+        else
+        {
+            trace(TraceErr, "free: Warning: Footer before %p does not match a free block. Skipping backward coalescing.\n", hdr);
+        }
+    }
+
+    // --- Coalescing (Merging with the next block) ---
+    // When a block is freed, we should check the block immediately following it. If the next block is also free, we can merge the newly freed block and the next free block into a single, larger free block. This reduces fragmentation.
+
+    // This is located immediately after the current block being freed.
+    header *next_blocks_header = (header *)((char *)hdr + hdr->w * Wordbytes);
+
+    // Calculate the offset of the potential next header.
+    word next_hdr_offset = hdr_offfset + hdr->w;
+
+    if (next_hdr_offset < c->words)
+    {
+        if (!next_blocks_header->alloced)
+        {
+            // Check if the next block has a valid non-zero size (safety).
+            if (next_blocks_header->w > 0)
+            {
+                if (!sealed(next_blocks_header))
+                    fatal("free: Error: Free block at %p after %p has a corrupted header.\n", next_blocks_header, hdr);
+
+                trace(TraceAll, "free: Coalescing with next free block at %p (size %lu words).\n", next_blocks_header, (word)next_blocks_header->w);
+
+                // The next block is about to disappear into this one, so take it off its free list first.
+                binRemove(a, next_blocks_header);
+                if (a->rover == next_blocks_header)
+                    a->rover = hdr;
+                hdr->w += next_blocks_header->w;
+                statAdd(a, coalesces, 1);
+                trace(TraceAll, "free: Merged block size is now %lu words.\n", (word)hdr->w);
+            }
+            else
+            {
+                trace(TraceErr, "free: Warning: Next block at %p has zero size. Skipping coalescing with it.\n", next_blocks_header);
+            }
+        }
+        else
+        {
+            trace(TraceAll, "free: Next block at %p is allocated. Cannot coalesce forward.\n", next_blocks_header);
+        }
+    }
+    else
+    {
+        trace(TraceAll, "free: No next block within bounds (offset %lu >= %lu). Cannot coalesce forward.\n", next_hdr_offset, c->words);
+    }
+
+    // Publish the (possibly merged) block on the free list for its final size,
+    // and write its footer so the next block can find it when that one is freed.
+    binInsert(a, hdr);
+    tagBoundary(hdr);
+#ifdef ALLOC_DEFER
+    bool large = hdr->w * Wordbytes >= Fastlimit;
+#endif
+
+    // A chunk that is now entirely free may be returned to the OS.
+    if (c != &a->first && chunkIsFree(c))
+        chunkTrim(a);
+
+    trace(TraceAll, "free: Free operation completed for pointer %p.\n", ptr);
+
+#ifdef ALLOC_DEFER
+    // A large free block hints that the heap is draining, so parked blocks are merged too.
+    if (large)
+        fastConsolidate_(a);
+#endif
+};
+
+#ifdef ALLOC_DEFER
+/*
+ * Deferred coalescing: small blocks freed into an arena are pushed onto a LIFO fast bin for their exact size instead of
+ * being merged, and an allocation of that size pops them again, so alloc/free churn at one size no longer merges a block
+ * on every free only for mkalloc to split it again on the next allocation.
+ * Parked blocks stay marked allocated in the heap, like blocks in thread caches, so nothing coalesces with them.
+ * The arena consolidates, freeing them all for real, once they add up to more than Fastlimit bytes and whenever an
+ * allocation finds no free block large enough.
+ */
+
+/*
+ * Returns whether the allocated block `hdr`, whose size has fast bin `i`, is parked in a fast bin of arena `a`.
+ * A parked block carries the address of the arena's fast bins in its second link word; only then is the bin searched.
+ */
+static bool fastHolds(arena *a, word i, header *hdr)
+{
+    if (linksof(hdr)->prev != (header *)a->fast)
+        return false;
+
+    for (header *parked = a->fast[i]; parked; parked = linksof(parked)->next)
+    {
+        if (parked == hdr)
+            return true;
+    }
+    return false;
+}
+
+// Returns whether the allocated block `hdr` of arena `a` is parked in any of its fast bins. The caller must hold the arena's lock.
+static bool fastParked_(arena *a, header *hdr)
+{
+    word i = fastBin(hdr->w);
+    return i < Fastbins && fastHolds(a, i, hdr);
+}
+
+/*
+ * Frees every block parked in the fast bins of arena `a`, coalescing each with its free neighbours.
+ * The caller must hold the arena's lock.
+ * Returns false if there was nothing to consolidate.
+ */
+bool fastConsolidate_(arena *a)
+{
+    if (!a->fastblocks)
+        return false;
+
+    trace(TraceAll, "free: Consolidating %lu parked blocks (%lu words) of arena %lu.\n", a->fastblocks, a->fastwords, (word)(a - arenas));
+
+    // The counters are cleared first, so the large blocks this forms do not start another consolidation (see coalesce_).
+    a->fastwords = 0;
+    a->fastblocks = 0;
+    for (word i = 0; i < Fastbins; i++)
+    {
+        while (a->fast[i])
+        {
+            header *hdr = a->fast[i];
+            a->fast[i] = linksof(hdr)->next;
+            coalesce_(chunkIn(a, hdr), hdr);
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Parks the validated allocated block `hdr` of arena `a` on its fast bin, consolidating the arena if the bins hold too much.
+ * The caller must hold the arena's lock.
+ * Returns false if the block is too large for the fast bins and has to be coalesced now.
+ */
+static bool fastFree_(arena *a, header *hdr)
+{
+    word i = fastBin(hdr->w);
+    if (i >= Fastbins)
+        return false;
+
+    if (fastHolds(a, i, hdr))
+    {
+#ifdef ALLOC_HARDEN
+        fatal("free: Error: Pointer %p (header %p) is already free (fast bin).\n", (void *)(hdr + 1), hdr);
+#endif
+        trace(TraceErr, "free: Error: Pointer %p (header %p) is already free (fast bin).\n", (void *)(hdr + 1), hdr);
+        return true;
+    }
+
+    linksof(hdr)->next = a->fast[i];
+    linksof(hdr)->prev = (header *)a->fast;
+    a->fast[i] = hdr;
+    a->fastwords += hdr->w;
+    a->fastblocks++;
+    trace(TraceAll, "free: Parked block at %p (%lu words) in fast bin %lu.\n", hdr, (word)hdr->w, i);
+
+    if (a->fastwords * Wordbytes > Fastlimit)
+        fastConsolidate_(a);
+    return true;
+}
+
+/*
+ * Serves an allocation of `words` data words from the fast bin of arena `a` for exactly that block size.
+ * The caller must hold the arena's lock.
+ * Returns NULL if the size has no fast bin or the bin is empty.
+ */
+static void *fastAlloc_(arena *a, word words)
+{
+    word i = fastBin(words + 1);
+    if (i >= Fastbins || !a->fast[i])
+        return NULL;
+
+    header *hdr = a->fast[i];
+    if (!sealed(hdr))
+        fatal("alloc: Error: Parked block at %p has a corrupted header.\n", hdr);
+
+    a->fast[i] = linksof(hdr)->next;
+    a->fastwords -= hdr->w;
+    a->fastblocks--;
+    linksof(hdr)->prev = NULL;
+
+    // All of the block was used before, so calloc_block has to clear all of it.
+    a->fresh = (char *)hdr + hdr->w * Wordbytes;
+
+    trace(TraceAll, "alloc: Reusing parked block at %p (%lu words) from fast bin %lu.\n", hdr, (word)hdr->w, i);
+    return (void *)(hdr + 1);
+}
+#endif
+
+/*
+ * Iterative search for a free memory block of at least `words_to_alloc` words.
+ * It walks one chunk block by block starting from `hdr`, which sits `n` words from the start of the chunk.
+ * The walk stops before offset `end`, so callers can search a slice of the chunk (next-fit wraps around this way).
+ * The first block that fits is returned.
+ * Returns a pointer to the header of a suitable free block, or NULL if none is found.
+*/
+header *findBlock_(header *hdr, word words_to_alloc, word n, word end)
+{
+    // We need space for the requested data (`words_to_alloc`) PLUS the header (1 word).
+    word total_required_size = words_to_alloc + 1;
+
+    // Walk forward one block at a time instead of recursing, so a heap full of small blocks cannot overflow the stack.
+    while (n < end)
+    {
+        trace(TraceAll, "findBlock_: Looking at block at %p, size %lu words, alloced=%d, n=%lu, request=%lu words\n", hdr, (word)hdr->w, hdr->alloced, n, words_to_alloc);
+        statProbe();
+
+        // A zero-sized header would make us loop forever on the same block.
+        if (hdr->w == 0)
+        {
+            trace(TraceErr, "findBlock_: Error: Zero-sized block at %p (offset %lu). Heap possibly corrupted.\n", hdr, n);
+            return NULL;
+        }
+
+        // Its size decides where the walk goes next, so it has to be genuine.
+        if (!sealed(hdr))
+            fatal("findBlock_: Error: Block at %p (offset %lu) has a corrupted header.\n", hdr, n);
+
+        // If current block is free AND large enough to satisfy our allocation request (data + header)
+        if (!hdr->alloced && hdr->w >= total_required_size)
+        {
+            trace(TraceAll, "findBlock_: Found suitable block at %p, size %lu words (requires %lu words total)\n", hdr, (word)hdr->w, total_required_size);
+            return hdr;
+        }
+
+        // Calculate the address of the next header.
+        // We move forward from the current header's address by the size of the current block (hdr->w), which is in words. Multiply by Wordbytes to get bytes.
+        n += hdr->w;
+        hdr = (header *)((char *)hdr + hdr->w * Wordbytes);
+    }
+
+    trace(TraceAll, "findBlock_: Reached end of search range (offset %lu). No suitable block found.\n", end);
+    return NULL;
+}
+
+// Search of findFit for the current policy.
+static header *policyFit(arena *a, word words_to_alloc)
+{
+    header *found = NULL;
+
+    switch (__atomic_load_n(&policy, __ATOMIC_RELAXED))
+    {
+    case FitFirst:
+        for (chunk *c = &a->first; c && !found; c = c->next)
+            found = findBlock(c, words_to_alloc, 0, c->words);
+        return found;
+
+    case FitBest:
+        return binBest(a, words_to_alloc + 1);
+
+    case FitNext:
+    {
+        // Resume from where the previous search stopped, visit the following chunks (wrapping to the first one),
+        // then finish with the part of the cursor's chunk before the cursor.
+        chunk *c = a->roverchunk ? a->roverchunk : &a->first;
+        word roveroff = a->rover ? offsetIn(c, a->rover) : 0;
+
+        found = findBlock(c, words_to_alloc, roveroff, c->words);
+        for (chunk *d = c->next ? c->next : &a->first; !found && d != c; d = d->next ? d->next : &a->first)
+        {
+            found = findBlock(d, words_to_alloc, 0, d->words);
+            if (found)
+                c = d;
+        }
+        if (!found)
+            found = findBlock(c, words_to_alloc, 0, roveroff);
+
+        if (found)
+        {
+            a->rover = found;
+            a->roverchunk = c;
+        }
+
+        return found;
+    }
+
+#ifdef ALLOC_FREEMAP
+    case FitMap:
+        for (chunk *c = &a->first; c && !found; c = c->next)
+            found = mapFind(c, words_to_alloc + 1);
+        return found;
+#endif
+
+    default:
+        return binFind(a, words_to_alloc + 1);
+    }
+}
+
+/*
+ * Finds a free block for `words_to_alloc` data words in arena `a` using the current search policy.
+ * FitBins and FitBest ask the arena's segregated free lists and size tree; FitFirst and FitNext walk the arena's blocks with findBlock_,
+ * and FitMap scans the chunks' freemaps.
+ * With ALLOC_STATS the number of blocks the search inspected goes into the arena's search histogram.
+ * Returns the header of a suitable free block, or NULL if none is found.
+ */
+header *findFit(arena *a, word words_to_alloc)
+{
+#ifdef ALLOC_STATS
+    probed = 0;
+    header *found = policyFit(a, words_to_alloc);
+
+    word k = probed ? binIndex(probed) + 1 : 0;
+    statAdd(a, searches[k < Probebuckets ? k : Probebuckets - 1], 1);
+    return found;
+#else
+    return policyFit(a, words_to_alloc);
+#endif
+}
+
+/*
+ * Selects the block search policy used by alloc() from now on (one of the Fit* constants).
+ * Returns false and sets errno to ErrInval if `p` is not a known policy, or is FitMap in a build without ALLOC_FREEMAP.
+ */
+bool setpolicy(int32 p)
+{
+#ifdef ALLOC_FREEMAP
+    if (p > FitMap)
+#else
+    if (p > FitBest)
+#endif
+    {
+        errno = ErrInval;
+        return false;
+    }
+
+    __atomic_store_n(&policy, p, __ATOMIC_RELAXED);
+    return true;
+}
+
+/*
+ * Raises the high-water mark of the chunk holding the allocated block `hdr` of arena `a` past the block.
+ * The mark also covers the header and links (or tree node) a split writes right after the block, so everything above it stays zero.
+ * The pages of that range are no longer released (see pagesUsed).
+ * Returns where the never-used part of the block begins, or the block's end if all of it was used before.
+ */
+static char *markUsed(arena *a, header *hdr)
+{
+    char *data = (char *)(hdr + 1);
+    char *end = (char *)hdr + hdr->w * Wordbytes;
+
+    chunk *c = chunkIn(a, hdr);
+
+    char *fresh = c->clean > data ? c->clean : data;
+    if (fresh > end)
+        fresh = end;
+
+    char *mark = end + sizeof(header) + (sizeof(node) > sizeof(links) ? sizeof(node) : sizeof(links));
+    if (mark > (char *)blockAt(c, c->words))
+        mark = (char *)blockAt(c, c->words);
+    if (mark > c->clean)
+        c->clean = mark;
+    pagesUsed(c, (char *)hdr, mark);
+
+    return fresh;
+}
+
+/*
+ * Allocates a block of memory in arena `a` with `words_to_alloc` word-sized units.
+ * `hdr` is the header of the *found* free block that is large enough.
+ * Returns a pointer to the usable memory (after the header).
+ * Implements block splitting for efficient memory usage when the found block is larger than needed.
+*/
+
+void *mkalloc(arena *a, word words_to_alloc, header *hdr)
+{
+    // Calculate how many words into the memspace this header is located.
+    // This is mainly for debugging output to show the block's position.
+    word wordsin = ((char *)hdr - (char *)memspace) / Wordbytes;
+
+    // Calculate the total size needed for the allocated block (data + header).
+    word total_required_size = words_to_alloc + 1;
+
+    trace(TraceAll, "mkalloc: Attempting to allocate %lu words (data + header) at offset %lu words (%p)\n", total_required_size, wordsin, hdr);
+
+    // The block comes from a free list or a heap walk, and in hardened mode its header must still be sealed.
+    if (!sealed(hdr))
+        fatal("mkalloc: Error: Free block at %p has a corrupted header.\n", hdr);
+
+    // Get the original total size of the found free block.
+    word original_size = hdr->w; // Size includes its own header
+
+    // The block is no longer free (or is about to shrink), so take it off its free list.
+    binRemove(a, hdr);
+
+    // If the original block is larger than what's required by at least Minwords, we can split it.
+    // The remainder must be able to hold its own header plus the free-list links.
+    if ((original_size - total_required_size) >= Minwords)
+    {
+        trace(TraceAll, "mkalloc: Splitting block - original size %lu words, allocating %lu words, remainder size %lu words.\n", original_size, total_required_size, original_size - total_required_size);
+
+        // Calculate the address for the header of the new free block (the remainder). It starts immediately after the allocated portion
+        header *next_hdr = (header *)((char *)hdr + total_required_size * Wordbytes);
+
+        // Set the size of the new free block.
+        next_hdr->w = original_size - total_required_size;
+        next_hdr->alloced = false; // Mark the remainder block as free.
+        next_hdr->prevfree = false; // The block before it is the one we are allocating.
+        binInsert(a, next_hdr);    // Make the remainder available to later allocations.
+        tagBoundary(next_hdr);     // Write its footer; the block after it already knows its predecessor is free.
+        trace(TraceAll, "mkalloc: Created new free block (remainder) at %p, size %lu words.\n", next_hdr, (word)next_hdr->w);
+
+        // Update the size of the block being allocated to reflect only the allocated portion.
+        hdr->w = total_required_size;
+        statAdd(a, splits, 1);
+    }
+    // If the remainder is too small to split, we just allocate the entire block we were given.
+    // In this case, hdr->w remains original_size, and no new free block is created after it.
+    // This path is taken if (original_size - total_required_size) < Minwords.
+    // Mark the block as allocated.
+    hdr->alloced = true;
+    mapBlock(a, hdr, hdr->w, false);
+
+    // The block after this one must no longer treat its predecessor as free.
+    // When we split, that block is the remainder, whose prevfree was already cleared above.
+    tagBoundary(hdr);
+
+    // Remember how much of the block was never used, for calloc_block.
+    a->fresh = markUsed(a, hdr);
+
+    statAdd(a, allocbytes, hdr->w * Wordbytes);
+    statAdd(a, allocblocks, 1);
+
+    trace(TraceAll, "mkalloc: Marked block at %p as allocated, size %lu words (data portion %lu words).\n", hdr, (word)hdr->w, words_to_alloc);
+    // Return a pointer to the usable memory area, which is immediately *after* the header.
+    // Pointer arithmetic 'hdr + 1' automatically moves the pointer by the size of 'header'.
+    return (void *)(hdr + 1);
+}
+
+// Requests of at least this many bytes are mapped directly by bigAlloc instead of coming from an arena.
+// Chosen at build time with -DALLOC_MMAP_THRESHOLD and changed at runtime with setmmapthreshold().
+static size_t mmapthreshold = ALLOC_MMAP_THRESHOLD;
+
+/*
+ * Allocates `bytes` bytes in a mapping of their own, bypassing the arenas and their block lists.
+ * The mapping starts with its length, followed by a header tagged as a direct mapping:
+ * size 0 and allocated, a combination no arena block ever has (there it only marks an epilogue).
+ * Returns pointer to allocated memory (the data area) or NULL on failure.
+ */
+void *bigAlloc(size_t bytes)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    // Sizes within a page of SIZE_MAX would wrap around in the rounding below and map a block far too small.
+    if (bytes > (size_t)-1 - Bigprefix - sizeof(header) - page)
+    {
+        trace(TraceOps, "alloc: Request for %zu bytes is too large.\n", bytes);
+        reterr(ErrNoMem);
+    }
+
+    size_t len = (Bigprefix + sizeof(header) + bytes + page - 1) & ~(page - 1);
+
+    trace(TraceOps, "alloc: Request for %zu bytes mapped directly (%zu-byte mapping)\n", bytes, len);
+
+#ifdef ALLOC_HUGEPAGES
+    // Only mappings that can hold a hugepage are worth aligning. They never use explicit hugepages,
+    // which bigRealloc could not resize a page at a time.
+    void *map = len >= Hugepage ? hugeMap(len, NULL) : mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#else
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#endif
+    if (map == MAP_FAILED)
+    {
+        trace(TraceOps, "alloc: mmap of %zu bytes failed.\n", len);
+        reterr(ErrNoMem);
+    }
+
+    *(size_t *)map = len;
+    statThread(mappedbytes, len);
+    statThread(mappedblocks, 1);
+
+    header *hdr = (header *)((char *)map + Bigprefix);
+    hdr->w = 0;
+    hdr->alloced = true;
+    hdr->prevfree = false;
+    seal(hdr);
+
+    return (void *)(hdr + 1);
+}
+
+/*
+ * Returns the start of the mapping of the block with header `hdr` if it was allocated by bigAlloc, or NULL otherwise.
+ * A direct mapping is recognised by its tag, by sitting right after its length at the start of a page,
+ * and by not being inside any chunk (every chunk's epilogue carries the same tag).
+ */
+char *bigMapping(header *hdr)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    char *map = (char *)hdr - Bigprefix;
+
+    if (!isBig(hdr) || ((size_t)map & (page - 1)) || chunkOf(hdr))
+        return NULL;
+
+    return map;
+}
+
+/*
+ * Unmaps the block with header `hdr` if it was allocated by bigAlloc.
+ * Returns false if the block is not a direct mapping; the caller then frees it as an arena block.
+ */
+bool bigFree(header *hdr)
+{
+    char *map = bigMapping(hdr);
+    if (!map)
+        return false;
+
+    size_t len = *(size_t *)map;
+    trace(TraceOps, "free: Unmapping directly mapped block %p (%zu-byte mapping)\n", (void *)(hdr + 1), len);
+
+    munmap(map, len);
+    statThread(mappedbytes, -len);
+    statThread(mappedblocks, -1);
+    return true;
+}
+
+/*
+ * Resizes the directly mapped block starting the mapping `map` so it can hold `bytes` bytes.
+ * The mapping is grown or shrunk with mremap, which moves it (without copying the pages) only if it cannot grow where it is.
+ * The block stays a direct mapping even if it shrinks below the mmap threshold.
+ * Returns pointer to the (possibly moved) data area, or NULL with errno set to ErrNoMem; the old block is then untouched.
+ */
+void *bigRealloc(char *map, size_t bytes)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t len = *(size_t *)map;
+
+    // As in bigAlloc, a size this close to SIZE_MAX would wrap around and shrink the mapping instead.
+    if (bytes > (size_t)-1 - Bigprefix - sizeof(header) - page)
+    {
+        trace(TraceOps, "realloc: Request for %zu bytes is too large.\n", bytes);
+        reterr(ErrNoMem);
+    }
+
+    size_t newlen = (Bigprefix + sizeof(header) + bytes + page - 1) & ~(page - 1);
+
+    if (newlen != len)
+    {
+        trace(TraceOps, "realloc: Remapping directly mapped block at %p from %zu to %zu bytes\n", (void *)map, len, newlen);
+
+        map = mremap(map, len, newlen, MREMAP_MAYMOVE);
+        if (map == MAP_FAILED)
+        {
+            trace(TraceOps, "realloc: mremap to %zu bytes failed.\n", newlen);
+            reterr(ErrNoMem);
+        }
+
+        *(size_t *)map = newlen;
+        statThread(mappedbytes, newlen - len);
+
+        // The seal covers the header's address, which changes if the mapping moved.
+        seal((header *)(map + Bigprefix));
+    }
+
+    return map + Bigprefix + sizeof(header);
+}
+
 /*
- * Frees a block of memory previously allocated by alloc().
- * Takes a pointer `ptr` to the data part of the allocated block.
- * Marks the corresponding block header as free.
- * Includes basic validation checks.
- * Does NOT yet include coalescing.
- */
-void freealloc(void *ptr)
+ * Sets the request size (in bytes) from which alloc() maps blocks directly instead of using the arenas.
+ */
+void setmmapthreshold(size_t bytes)
+{
+    __atomic_store_n(&mmapthreshold, bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the number of data words alloc() reserves for a request of `bytes` bytes.
+ * The size is rounded up so the whole block (header included) is a multiple of the alignment,
+ * and never below what a block needs to hold its free-list links and footer once freed.
+ * Returns 0 with errno set to ErrNoMem if the block would not fit in a header's size field; no real block has 0 data words.
+ */
+word wordsFor(size_t bytes)
+{
+    // Checked before any rounding, which would wrap around for sizes near SIZE_MAX.
+    // In 64-bit builds the size field holds more than the address space; no mapping can take half of that, let alone a chunk.
+    if (bytes / Wordbytes >= Maxblockwords - Alignwords || bytes >= (size_t)-1 / 2)
+    {
+        trace(TraceOps, "alloc: Request for %zu bytes is too large for a heap block.\n", bytes);
+        errno = ErrNoMem;
+        return 0;
+    }
+
+    // The expression `(bytes + Wordbytes - 1) / Wordbytes` performs integer division equivalent to ceil(bytes / (double)Wordbytes).
+    word words = alignWords((bytes + Wordbytes - 1) / Wordbytes + 1) - 1;
+
+    // Every block must be able to hold its free-list links once freed, so never hand out less than Minwords in total.
+    if (words + 1 < Minwords)
+        words = Minwords - 1;
+
+    return words;
+}
+
+// Every arena's first block spans its whole slice of memspace, so the slice must fit in a header's size field.
+_Static_assert(Maxwords <= Maxblockwords, "Heapbytes is too large for the block size field (hardened 32-bit builds allow up to 16 MB)");
+
+#ifdef ALLOC_THREADS
+/*
+ * Remote frees: a block freed by a thread whose arena is not the block's own is pushed onto the owning arena's
+ * remote stack with a compare-and-swap instead of taking the owner's lock, so producer/consumer pairs do not fight over it.
+ * The owner's threads free the whole stack in one go the next time they hold the lock to allocate or free, and when they exit;
+ * alloc_stats() and the trimmer drain every stack too, so blocks queued for an arena nobody allocates from are neither
+ * counted as in use nor kept resident.
+ */
+
+/*
+ * Queues the allocated block `hdr` on the remote stack of its arena if that is not the calling thread's arena.
+ * Returns false if the block belongs to the calling thread's arena or is not an allocated heap block,
+ * in which case the caller frees it as usual (which also reports invalid pointers).
+ */
+bool remoteFree(header *hdr)
+{
+    chunk *c = chunkOf(hdr);
+    if (!c || !hdr->alloced || c->owner == threadArena())
+        return false;
+
+    arena *a = c->owner;
+    trace(TraceAll, "free: Queueing %p for arena %lu.\n", (void *)(hdr + 1), (word)(a - arenas));
+
+    // The owner takes the whole stack at once, so a block can never be popped and pushed again under a push (no ABA problem).
+    header *head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+    do
+        linksof(hdr)->next = head;
+    while (!__atomic_compare_exchange_n(&a->remote, &head, hdr, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return true;
+}
+
+/*
+ * Frees every block queued on the remote stack of arena `a`. The caller must hold the arena's lock.
+ * A block queued twice (a double free from other threads) is already free when it comes around again,
+ * and its links then belong to a free list, so the rest of the stack is dropped rather than followed.
+ */
+void remoteDrain_(arena *a)
+{
+    if (!__atomic_load_n(&a->remote, __ATOMIC_RELAXED))
+        return;
+
+    header *hdr = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+    while (hdr)
+    {
+        if (!hdr->alloced)
+        {
+            trace(TraceErr, "free: Error: Pointer %p (header %p) was freed twice by other threads.\n", (void *)(hdr + 1), hdr);
+            return;
+        }
+
+        header *next = linksof(hdr)->next;
+        freealloc_(hdr + 1);
+        hdr = next;
+    }
+}
+#endif
+
+/*
+ * Sets up arena `a` on the first allocation from it, if that has not happened yet.
+ * Its slice of memspace becomes its first chunk, holding one free block that spans the whole slice.
+ * The caller must hold the arena's lock.
+ */
+static void arenaInit(arena *a)
+{
+    word i = a - arenas;
+    header *hdr = arenaBase(i); // Pointer to the very first header in the arena.
+    word size = arenaWords(i);  // Words of memspace available to the arena's blocks.
+
+    // Check if the arena is uninitialized. We use the size field of its first header as an indicator.
+    // If hdr->w is 0, it implies the memory block is in its zero-initialized state from .bss.
+    if (hdr->w == 0)
+    {
+        trace(TraceAll, "alloc: First allocation detected - initializing metadata of arena %lu.\n", i);
+        numaBind(hdr, (size + 1) * Wordbytes, arenaNode(a));
+        // The arena's slice of memspace becomes the first chunk of its chunk list.
+        a->first.base = hdr;
+        a->first.words = size;
+        a->first.clean = (char *)(nodeof(hdr) + 1); // memspace is zero (.bss) apart from what we write here.
+        a->first.owner = a;
+#ifdef ALLOC_FREEMAP
+        a->first.freemap = slicemaps[i];
+#endif
+        a->first.pagemap = slicepages[i];
+#ifdef ALLOC_HUGEPAGES
+        hugeAdvise((char *)hdr, (char *)blockAt(&a->first, size));
+#endif
+        a->tail = &a->first;
+        a->words = size;
+
+        // Initialize the first block's header to represent the entire arena as one large free block.
+        hdr->w = size;
+        hdr->alloced = false; // The entire arena is initially free.
+
+        // The word right after the arena's blocks is its epilogue: a zero-sized block that is never free.
+        // It stops coalescing at the arena boundary and gives the last block a successor for its prevfree bit.
+        header *epilogue = blockAt(&a->first, size);
+        epilogue->w = 0;
+        epilogue->alloced = true;
+
+        binInsert(a, hdr);    // It is the only entry on the free lists.
+        tagBoundary(hdr);     // Write its footer at the very end of the arena.
+        mapMark(&a->first, 0, size, true);
+
+        trace(TraceAll, "alloc: Initialized arena %lu first block with size %lu words.\n", i, (word)hdr->w);
+    }
+}
+
+/*
+ * Allocates `bytes` bytes from arena `a` of the shared heap.
+ * Rounds the requested size up to the nearest multiple of the alignment.
+ * Handles the initial arena setup on the first allocation from it.
+ * Finds a suitable free block using findFit and marks it as allocated using mkalloc.
+ * In thread-safe builds the caller must hold the arena's lock; use alloc() for the public entry point.
+ * Returns pointer to allocated memory (the data area) or NULL on failure.
+*/
+void *alloc_(arena *a, size_t bytes)
+{
+    word i = a - arenas;
+
+    // Calculate the number of words needed for the data.
+    word words = wordsFor(bytes);
+    if (!words)
+        return NULL;
+
+    trace(TraceOps, "alloc: Request for %zu bytes (%lu words)\n", bytes, words);
+
+    arenaInit(a);
+    remoteDrain_(a);
+
+#ifdef ALLOC_DEFER
+    void *parked = fastAlloc_(a, words);
+    if (parked)
+        return parked;
+#endif
+
+    // Find a suitable free block in the arena using the selected search policy.
+    // We pass the number of words requested for *data* (`words`).
+    header *found = findFit(a, words);
+
+    // If findFit returns NULL, merging any parked blocks may make room; failing that, grow the arena with a new chunk from the OS.
+    if (!found && fastConsolidate_(a))
+        found = findFit(a, words);
+    if (!found)
+        found = chunkGrow(a, words);
+
+    if (!found)
+    {
+        trace(TraceOps, "alloc: No suitable free block found for %lu words (including header) in arena %lu.\n", words + 1, i);
+        // Neither findFit nor chunkGrow set errno, so we set it here.
+        errno = ErrNoMem;
+        return NULL;
+    }
+
+    // Mark the found block as allocated and handle potential splitting if it's larger than needed.
+    // mkalloc takes the requested *data* size in words and the header of the found block.
+    return mkalloc(a, words, found);
+}
+
+/*
+ * Allocates `bytes` bytes from arena `a` at an address that is a multiple of `align`, a power of two above ALLOC_ALIGN.
+ * Searches for a block with room for the worst-case padding, then splits it twice with mkalloc:
+ * the padding in front of the aligned address becomes a block of its own, which is freed straight away
+ * (merging with a free predecessor), and the aligned block is carved from what follows it.
+ * In thread-safe builds the caller must hold the arena's lock; use alloc_aligned() for the public entry point.
+ * Returns pointer to allocated memory (the data area) or NULL on failure.
+ */
+void *allocAligned_(arena *a, size_t bytes, word align)
+{
+    word words = wordsFor(bytes);
+
+    // Padding is either nothing or a whole block, so it can take up to one alignment step plus Minwords.
+    word slack = (align + Minwords * Wordbytes) / Wordbytes;
+    if (!words || words > Maxblockwords - slack)
+    {
+        trace(TraceOps, "alloc: Request for %zu bytes aligned to %lu bytes is too large for a heap block.\n", bytes, align);
+        reterr(ErrNoMem);
+    }
+
+    trace(TraceOps, "alloc: Request for %zu bytes (%lu words) aligned to %lu bytes\n", bytes, words, align);
+
+    arenaInit(a);
+    remoteDrain_(a);
+
+    header *found = findFit(a, words + slack);
+    if (!found && fastConsolidate_(a))
+        found = findFit(a, words + slack);
+    if (!found)
+        found = chunkGrow(a, words + slack);
+
+    if (!found)
+    {
+        trace(TraceOps, "alloc: No suitable free block found for %lu aligned words in arena %lu.\n", words + 1, (word)(a - arenas));
+        errno = ErrNoMem;
+        return NULL;
+    }
+
+    // The first aligned address far enough into the block to leave either no padding or room for a padding block.
+    char *data = (char *)(found + 1);
+    char *aligned = (char *)(((size_t)data + align - 1) & ~(size_t)(align - 1));
+    while (aligned > data && aligned - data < (ptrdiff_t)(Minwords * Wordbytes))
+        aligned += align;
+
+    word pad = (aligned - data) / Wordbytes;
+    if (pad)
+    {
+        // Allocate the padding as a block of its own so mkalloc splits the aligned part off as a free remainder.
+        header *rest = (header *)((char *)found + pad * Wordbytes);
+        trace(TraceAll, "alloc: Splitting off %lu words of padding at %p.\n", pad, found);
+
+        mkalloc(a, pad - 1, found);
+        found = rest;
+    }
+
+    void *ptr = mkalloc(a, words, found);
+
+    // The padding becomes free again; this can only merge backwards, as the block after it is the one we return.
+    if (pad)
+        freealloc_(data);
+
+    return ptr;
+}
+
+/*
+ * Allocates up to `n` blocks of `bytes` bytes each from arena `a`, storing them in `out`.
+ * The blocks are carved in one pass from a single free block large enough for the whole batch, with one free-list removal
+ * and one remainder split for all of them; if there is no such block, they are allocated one by one.
+ * In thread-safe builds the caller must hold the arena's lock; use alloc_batch() for the public entry point.
+ * Returns the number of blocks allocated.
+ */
+size_t allocBatch_(arena *a, size_t bytes, size_t n, void **out)
+{
+    word words = wordsFor(bytes);
+    word total_required_size = words + 1;
+    size_t done = 0;
+    if (!words)
+        return 0;
+
+    trace(TraceOps, "alloc: Batch request for %zu x %zu bytes (%lu words each)\n", n, bytes, words);
+
+    arenaInit(a);
+    remoteDrain_(a);
+
+    header *hdr = NULL;
+    if (n <= Maxblockwords / total_required_size)
+    {
+        word batch = n * total_required_size;
+
+        hdr = findFit(a, batch - 1);
+        if (!hdr && fastConsolidate_(a))
+            hdr = findFit(a, batch - 1);
+        if (!hdr)
+            hdr = chunkGrow(a, batch - 1);
+    }
+
+    if (hdr && !sealed(hdr))
+        fatal("alloc: Error: Free block at %p has a corrupted header.\n", hdr);
+
+    if (hdr)
+    {
+        word original_size = hdr->w;
+        binRemove(a, hdr);
+
+        header *last = hdr;
+        for (size_t k = 0; k < n; k++)
+        {
+            last = (header *)((char *)hdr + k * total_required_size * Wordbytes);
+            last->w = total_required_size;
+            last->alloced = true;
+            last->prevfree = false; // The first block follows an allocated block, as every free block does.
+            seal(last);
+            out[done++] = last + 1;
+        }
+
+        // The remainder after the batch becomes a free block, or goes to the last object if it is too small for one.
+        word remainder = original_size - n * total_required_size;
+        if (remainder >= Minwords)
+        {
+            header *rest = (header *)((char *)last + total_required_size * Wordbytes);
+            rest->w = remainder;
+            rest->alloced = false;
+            rest->prevfree = false;
+            binInsert(a, rest);
+            tagBoundary(rest);
+        }
+        else
+        {
+            last->w += remainder;
+        }
+
+        tagBoundary(last);
+        pagesUsed(chunkIn(a, hdr), (char *)hdr, (char *)last);
+        markUsed(a, last);
+        mapBlock(a, hdr, original_size - (remainder >= Minwords ? remainder : 0), false);
+
+        statAdd(a, allocbytes, (original_size - (remainder >= Minwords ? remainder : 0)) * Wordbytes);
+        statAdd(a, allocblocks, n);
+        statAdd(a, splits, remainder >= Minwords);
+
+        trace(TraceAll, "alloc: Carved %zu blocks of %lu words from block at %p.\n", n, total_required_size, hdr);
+    }
+
+    for (; done < n; done++)
+    {
+        out[done] = alloc_(a, bytes);
+        if (!out[done])
+            break;
+    }
+
+    return done;
+}
+
+/*
+ * Tries to resize the allocated block `hdr` of arena `a` in place so it holds `words` data words.
+ * A shrinking block splits its tail off as a free block, which merges with a free successor.
+ * A growing block absorbs its successor when that one is free and large enough, and gives back whatever it does not need.
+ * In thread-safe builds the caller must hold the arena's lock; use realloc_block() for the public entry point.
+ * Returns false if the block cannot grow where it is; the caller then has to move it.
+ */
+bool resize_(arena *a, header *hdr, word words)
+{
+    word total_required_size = words + 1;
+    word original_size = hdr->w;
+    header *next = (header *)((char *)hdr + hdr->w * Wordbytes);
+
+    // The last block of a chunk is followed by its epilogue, which is never free, so no bounds check is needed here.
+    if (hdr->w < total_required_size)
+    {
+        if (next->alloced || (word)hdr->w + next->w < total_required_size)
+            return false;
+
+        if (!sealed(next))
+            fatal("realloc: Error: Free block at %p after %p has a corrupted header.\n", next, hdr);
+
+        trace(TraceAll, "realloc: Growing block at %p into next free block at %p (size %lu words).\n", hdr, next, (word)next->w);
+
+        binRemove(a, next);
+        if (a->rover == next)
+            a->rover = hdr;
+        mapBlock(a, next, next->w, false);
+        hdr->w += next->w;
+
+        // The block after the absorbed one now follows an allocated block.
+        tagBoundary(hdr);
+        next = (header *)((char *)hdr + hdr->w * Wordbytes);
+    }
+
+    // Split off the surplus, as mkalloc does with the remainder of a block it allocates.
+    word surplus = hdr->w - total_required_size;
+    if (surplus >= Minwords)
+    {
+        header *rest = (header *)((char *)hdr + total_required_size * Wordbytes);
+        rest->w = surplus;
+        rest->alloced = false;
+        rest->prevfree = false;
+        hdr->w = total_required_size;
+        seal(hdr);
+        mapBlock(a, rest, surplus, true); // A free successor it absorbs below is marked already.
+
+        // The surplus may border a free block (a shrinking block's successor), which it then absorbs.
+        if (!next->alloced)
+        {
+            if (!sealed(next))
+                fatal("realloc: Error: Free block at %p after %p has a corrupted header.\n", next, hdr);
+
+            binRemove(a, next);
+            if (a->rover == next)
+                a->rover = rest;
+            rest->w += next->w;
+            statAdd(a, coalesces, 1);
+        }
+
+        binInsert(a, rest);
+        tagBoundary(rest);
+        statAdd(a, splits, 1);
+        trace(TraceAll, "realloc: Split off free block at %p, size %lu words.\n", rest, (word)rest->w);
+    }
+
+    // The kept block may now reach memory that was never used; it must not be taken for zero by calloc_block later.
+    // Marked only once the surplus is split off, so the free remainder stays clean.
+    markUsed(a, hdr);
+
+    statAdd(a, allocbytes, (hdr->w - original_size) * Wordbytes);
+    return true;
+}
+
+/*
+ * Allocates like arenaAlloc, starting from arena `home`.
+ * With NUMA placement the other arenas of `home`'s node are tried before those of other nodes.
+ */
+static void *homeAlloc(arena *home, size_t bytes, word align, char **fresh)
+{
+    void *ptr = NULL;
+
+    for (word pass = 0; !ptr && pass < 2; pass++)
+    {
+        for (word n = 0; !ptr && n < Arenas; n++)
+        {
+            arena *a = &arenas[(home - arenas + n) % Arenas];
+            if ((arenaNode(a) == arenaNode(home)) != (pass == 0))
+                continue;
+
+            lockarena(a);
+            ptr = align ? allocAligned_(a, bytes, align) : alloc_(a, bytes);
+            if (ptr && fresh)
+                *fresh = a->fresh;
+            unlockarena(a);
+        }
+    }
+
+    return ptr;
+}
+
+/*
+ * Allocates `bytes` bytes from the calling thread's arena, taking its lock.
+ * If that arena is out of memory, the other arenas are tried in turn so no memory is stranded in an idle arena.
+ * `align` is 0 for the default alignment, or a power of two above ALLOC_ALIGN that the address must be a multiple of.
+ * If `fresh` is not NULL, it receives where the never-used part of the block begins (see markUsed).
+ * Returns pointer to allocated memory (the data area) or NULL on failure.
+ */
+void *arenaAlloc(size_t bytes, word align, char **fresh)
+{
+    return homeAlloc(threadArena(), bytes, align, fresh);
+}
+
+#ifdef ALLOC_THREADS
+/*
+ * Per-thread cache (tcache) in front of the shared heap.
+ * Each thread keeps a few recently freed small blocks per exact block size.
+ * Cached blocks stay marked allocated in the heap, so nobody else can coalesce or hand them out.
+ * Arena locks are only taken when a bin is empty (refill) or full (flush).
+ */
+
+// One cache per thread, indexed by block size (see tcacheBin).
+struct s_tcache
+{
+    header *head[Tcachebins]; // LIFO stack of cached blocks, linked through linksof(hdr)->next.
+    int8 count[Tcachebins];   // Number of blocks on each stack (at most Tcachemax).
+    bool registered;          // Whether the thread-exit destructor has been armed for this thread.
+};
+
+static __thread struct s_tcache tcache;
+
+// Key whose destructor flushes a thread's cache back to the heap when the thread exits.
+static pthread_key_t tcachekey;
+static pthread_once_t tcacheonce = PTHREAD_ONCE_INIT;
+
+/*
+ * Frees blocks from the top of the calling thread's cache bin `i` back to the heap until only `keep` remain.
+ * A bin can hold blocks from several arenas (fallback allocations, blocks freed by another thread),
+ * so each block goes to its owning arena; the lock is only switched when the owner changes.
+ */
+static void tcacheDrain(word i, word keep)
+{
+    arena *held = NULL;
+
+    while (tcache.count[i] > keep)
+    {
+        header *hdr = tcache.head[i];
+        tcache.head[i] = linksof(hdr)->next;
+        tcache.count[i]--;
+        statThread(cachedbytes, -(hdr->w * Wordbytes));
+        statThread(cachedblocks, -1);
+
+        arena *a = arenaOf(hdr);
+        if (a != held)
+        {
+            if (held)
+                unlockarena(held);
+            lockarena(a);
+            held = a;
+        }
+        freealloc_(hdr + 1);
+    }
+
+    if (held)
+        unlockarena(held);
+}
+
+/*
+ * Returns every block cached by the calling thread to the shared heap.
+ * Runs as the tcachekey destructor at thread exit; `cache` is the value registered with pthread_setspecific.
+ */
+static void tcacheFlushAll(void *cache unused)
+{
+    for (word i = 0; i < Tcachebins; i++)
+        tcacheDrain(i, 0);
+}
+
+static void tcacheKeyInit(void)
+{
+    pthread_key_create(&tcachekey, tcacheFlushAll);
+}
+
+/*
+ * Pushes an allocated block onto the calling thread's cache bin `i`.
+ * The second link word is set to the address of this thread's cache, which lets tcacheFree spot a block that is freed twice.
+ */
+static void tcachePush(word i, header *hdr)
+{
+    linksof(hdr)->next = tcache.head[i];
+    linksof(hdr)->prev = (header *)&tcache;
+    tcache.head[i] = hdr;
+    tcache.count[i]++;
+    statThread(cachedbytes, hdr->w * Wordbytes);
+    statThread(cachedblocks, 1);
+}
+
+/*
+ * Tries to serve an allocation of `words` data words from the calling thread's cache.
+ * On a miss, refills the bin with Tcachefill blocks taken from the thread's arena under a single lock.
+ * Returns NULL if the size is not cached or the heap could not supply a block; the caller then falls back to the heap.
+ */
+void *tcacheAlloc(word words)
+{
+    word i = tcacheBin(words + 1);
+    if (i >= Tcachebins)
+        return NULL;
+
+    if (!tcache.head[i])
+    {
+        trace(TraceAll, "tcache: Refilling bin for %lu-word blocks.\n", words + 1);
+
+        arena *a = threadArena();
+
+        lockarena(a);
+        for (word n = 0; n < Tcachefill; n++)
+        {
+            void *ptr = alloc_(a, words * Wordbytes);
+            if (!ptr)
+                break;
+
+            // mkalloc may hand out a slightly larger block when the remainder is too small to split; cache it under its real size.
+            header *hdr = (header *)ptr - 1;
+            word j = tcacheBin(hdr->w);
+            if (j < Tcachebins && tcache.count[j] < Tcachemax)
+                tcachePush(j, hdr);
+            else
+                freealloc_(ptr);
+        }
+        unlockarena(a);
+
+        // Arm the destructor so whatever this thread still caches goes back to the heap when it exits.
+        if (!tcache.registered)
+        {
+            pthread_once(&tcacheonce, tcacheKeyInit);
+            pthread_setspecific(tcachekey, &tcache);
+            tcache.registered = true;
+        }
+    }
+
+    header *hdr = tcache.head[i];
+    if (!hdr)
+        return NULL;
+
+    tcache.head[i] = linksof(hdr)->next;
+    tcache.count[i]--;
+    linksof(hdr)->prev = NULL;
+    statThread(cachedbytes, -(hdr->w * Wordbytes));
+    statThread(cachedblocks, -1);
+    return (void *)(hdr + 1);
+}
+
+/*
+ * Returns whether the allocated block `hdr`, whose size has cache bin `i`, is in the calling thread's cache.
+ * A cached block carries this thread's cache address in its second link word.
+ * If it matches, make sure the block really is on our stack, as a live block's data may hold anything.
+ */
+static bool tcacheHolds(word i, header *hdr)
+{
+    if (i >= Tcachebins || linksof(hdr)->prev != (header *)&tcache)
+        return false;
+
+    for (header *cached = tcache.head[i]; cached; cached = linksof(cached)->next)
+    {
+        if (cached == hdr)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Tries to keep a freed block in the calling thread's cache.
+ * When the bin is full, half of it is flushed back to the heap first.
+ * Returns false if the block is not cacheable (wrong size, not an allocated heap block); the caller then frees it to the heap,
+ * which also reports invalid pointers.
+ */
+bool tcacheFree(header *hdr)
+{
+    // Only the owner of an allocated block changes its size or alloced bit, so they can be read without the lock.
+    // (Neighbours may still update the prevfree bit in the same header word under the lock.)
+    if (!chunkOf(hdr) || !hdr->alloced)
+        return false;
+
+    word i = tcacheBin(hdr->w);
+    if (i >= Tcachebins)
+        return false;
+
+    if (tcacheHolds(i, hdr))
+    {
+        trace(TraceErr, "free: Error: Pointer %p (header %p) is already free (thread cache).\n", (void *)(hdr + 1), hdr);
+        return true;
+    }
+
+    if (tcache.count[i] >= Tcachemax)
+    {
+        trace(TraceAll, "tcache: Flushing bin for %lu-word blocks.\n", (word)hdr->w);
+
+        tcacheDrain(i, Tcachemax / 2);
+    }
+
+    tcachePush(i, hdr);
+    return true;
+}
+#endif
+
+#ifdef ALLOC_HARDEN
+/*
+ * Quarantine of freed blocks (hardened mode).
+ * freealloc() parks each block in a per-thread FIFO ring, and it only goes back to the thread cache or the heap Quarantineslots
+ * frees later, so a dangling pointer does not reach memory that was handed out again in the meantime.
+ * The start of a parked block is poisoned; if that has changed by the time the block leaves, it was written after it was freed.
+ * Parked headers are left alone, as neighbours may update their prevfree bits under the arena lock at any time,
+ * and alloc_stats() counts parked blocks as allocated.
+ */
+#if Quarantineslots
+struct s_quarantine
+{
+    header *slots[Quarantineslots]; // Parked blocks, oldest first from `next` on once the ring is full.
+    word next;                      // Slot the next block is parked in.
+    bool registered;                // Whether the thread-exit destructor has been armed for this thread.
+};
+
+static threadlocal struct s_quarantine quarantine;
+
+// Bytes poisoned at the start of the data of block `hdr`.
+#define poisonBytes(hdr) ((word)(hdr)->w - 1 < Poisonbytes / Wordbytes ? ((word)(hdr)->w - 1) * Wordbytes : (word)Poisonbytes)
+
+// Returns whether the poison at the start of block `hdr` is intact, comparing a word at a time.
+static bool poisoned(header *hdr)
 {
-    if (ptr == NULL)
+    const word *p = (const word *)(hdr + 1);
+    for (word i = 0; i < poisonBytes(hdr) / Wordbytes; i++)
     {
-        // Standard C behavior: calling free(NULL) has no effect.
-        printf("free: Called with NULL pointer. Doing nothing.\n");
-        return;
+        if (p[i] != ~(word)0 / 0xff * Poisonbyte)
+            return false;
     }
+    return true;
+}
 
-    printf("free: Attempting to free pointer %p\n", ptr);
+#endif
 
-    // Calculate the address of the block header.
-    // The header is always located immediately before the data pointer returned by alloc.
-    // By casting the void pointer to a header pointer and subtracting 1,
-    // pointer arithmetic moves back by sizeof(header) bytes.
-    header *hdr = (header *)ptr - 1;
+/*
+ * Checks that `ptr` (with header `hdr`) is an allocated block that may be freed or resized, and stops the process if not:
+ * its header must be sealed and allocated, and it must not be parked in the calling thread's quarantine or cache, or in a fast bin.
+ * Only a block whose poison is intact can be parked, so the quarantine is only searched for those.
+ */
+static void quarantineCheck(void *ptr, header *hdr)
+{
+    if (!sealed(hdr) || !hdr->alloced)
+        fatal("free: Error: Pointer %p (header %p) is not an allocated block: corrupted header or double free.\n", ptr, hdr);
 
-    // --- Basic Validation Checks ---
-    // These checks help prevent crashes or heap corruption from invalid free calls.
-    // Check if the calculated header address is within the bounds of our memspace.
-    // A valid header must be at or after the start of memspace and sufficiently before the end to potentially describe a block (at least 1 word for the header itself).
+#if Quarantineslots
+    if (!isBig(hdr) && poisoned(hdr))
+    {
+        for (word i = 0; i < Quarantineslots; i++)
+        {
+            if (quarantine.slots[i] == hdr)
+                fatal("free: Error: Pointer %p (header %p) is already free (quarantine).\n", ptr, hdr);
+        }
+    }
+#endif
+
+#ifdef ALLOC_THREADS
+    if (!isBig(hdr) && tcacheHolds(tcacheBin(hdr->w), hdr))
+        fatal("free: Error: Pointer %p (header %p) is already free (thread cache).\n", ptr, hdr);
+#endif
 
-    // Calculate the offset of the header form the sstart of the memspace
-    word hdr_offfset = ((char *)hdr - (char *)memspace) / 4;
-    if (hdr < (header *)memspace || hdr_offfset >= Maxwords)
+#ifdef ALLOC_DEFER
+    // Parked blocks are still marked allocated too; the arena is only locked for those that carry its fast bin tag.
+    arena *a = isBig(hdr) ? NULL : arenaOf(hdr);
+    if (a && fastBin(hdr->w) < Fastbins && linksof(hdr)->prev == (header *)a->fast)
     {
-        printf("free: Error: Invalid pointer %p (calculated header %p, offset %d) - outside heap bounds.\n", ptr, hdr, hdr_offfset);
-        // In a real system, this might abort or log a critical error.
-        // We'll print and return for now.
-        return;
+        lockarena(a);
+        bool parked = fastHolds(a, fastBin(hdr->w), hdr);
+        unlockarena(a);
+        if (parked)
+            fatal("free: Error: Pointer %p (header %p) is already free (fast bin).\n", ptr, hdr);
     }
+#endif
+}
 
-    // Check if the block is currently marked as allocated.
-    // Freeing a block that is already free (double-free) is an error.
-    if (!hdr->alloced)
+#if Quarantineslots
+/*
+ * Checks that block `hdr`, leaving the quarantine, was not touched while it was parked.
+ */
+static void quarantineLeave(header *hdr)
+{
+    if (!sealed(hdr))
+        fatal("free: Error: Freed block at %p had its header overwritten while in quarantine.\n", hdr);
+    if (!poisoned(hdr))
+        fatal("free: Error: Freed block at %p was written to after it was freed.\n", (void *)(hdr + 1));
+}
+
+#ifdef ALLOC_THREADS
+// Key whose destructor frees a thread's quarantine when the thread exits.
+static pthread_key_t quarantinekey;
+static pthread_once_t quarantineonce = PTHREAD_ONCE_INIT;
+
+/*
+ * Frees every block in the calling thread's quarantine straight to the heap, as the thread cache may already be gone.
+ * Runs as the quarantinekey destructor at thread exit.
+ */
+static void quarantineFlush(void *q unused)
+{
+    for (word i = 0; i < Quarantineslots; i++)
     {
-        printf("free: Error: Pointer %p (header %p) is already free.\n", ptr, hdr);
-        // Again, might abort or log in a real system.
-        return;
+        header *hdr = quarantine.slots[i];
+        if (!hdr)
+            continue;
+
+        quarantineLeave(hdr);
+        quarantine.slots[i] = NULL;
+
+        arena *a = arenaOf(hdr);
+        lockarena(a);
+        freealloc_(hdr + 1);
+        unlockarena(a);
     }
+}
 
-    // Check for a zero-sized block being freed. While unlikely with current alloc,
-    // it's a safety check against corruption. A valid header should have w >= 1.
-    if (hdr->w == 0)
+static void quarantineKeyInit(void)
+{
+    pthread_key_create(&quarantinekey, quarantineFlush);
+}
+#endif
+
+/*
+ * Parks the block `ptr` in the calling thread's quarantine after checking that it may be freed (see quarantineCheck).
+ * Directly mapped blocks are not parked: they are unmapped right away, so a dangling pointer to one faults.
+ * Returns the block to free now: `ptr` itself if it is not parked, the oldest parked block if the ring was full, or NULL.
+ */
+static void *quarantineFree(void *ptr)
+{
+    header *hdr = (header *)ptr - 1;
+
+    quarantineCheck(ptr, hdr);
+    if (isBig(hdr))
+        return ptr;
+
+    memset(ptr, Poisonbyte, poisonBytes(hdr));
+
+    header *oldest = quarantine.slots[quarantine.next];
+    quarantine.slots[quarantine.next] = hdr;
+    if (++quarantine.next == Quarantineslots)
+        quarantine.next = 0;
+
+#ifdef ALLOC_THREADS
+    if (!quarantine.registered)
     {
-        printf("free: Error: Pointer %p (header %p) has a zero size header. Heap possibly corrupted.\n", ptr, hdr);
-        return;
+        pthread_once(&quarantineonce, quarantineKeyInit);
+        pthread_setspecific(quarantinekey, &quarantine);
+        quarantine.registered = true;
     }
+#endif
 
-    // --- Mark the block as free ---
-    hdr->alloced = false;
-    printf("free: Marked block at %p (header %p, size %d words) as free.\n", ptr, hdr, hdr->w);
+    if (!oldest)
+        return NULL;
 
-    // --- Coalescing (Merging with the next block) ---
-    // When a block is freed, we should check the block immediately following it. If the next block is also free, we can merge the newly freed block and the next free block into a single, larger free block. This reduces fragmentation.
+    quarantineLeave(oldest);
+    return oldest + 1;
+}
+#endif
+#endif
 
-    // This is located immediately after the current block being freed.
-    header *next_blocks_header = (header *)((char *)hdr + hdr->w * 4);
+// Body of alloc(), which the other entry points share without logging the call twice when recording.
+static void *allocBlock(size_t bytes)
+{
+    // Large requests get their own mapping instead of splitting (and later fragmenting) a chunk.
+    if (bytes >= __atomic_load_n(&mmapthreshold, __ATOMIC_RELAXED))
+        return bigAlloc(bytes);
 
-    // Calculate the offset of the potential next header.
-    word next_hdr_offset = hdr_offfset + hdr->w;
+#ifdef ALLOC_THREADS
+    void *cached = tcacheAlloc(wordsFor(bytes));
+    if (cached)
+        return cached;
+#endif
+
+    return arenaAlloc(bytes, 0, NULL);
+}
+
+/*
+ * Top-level malloc-like function. Tries to allocate a block of `bytes` size.
+ * Requests of at least the mmap threshold are mapped directly from the OS (see bigAlloc).
+ * In thread-safe builds small requests are served from the calling thread's cache first,
+ * and the shared heap is only touched under the lock of one arena at a time.
+ * Returns pointer to allocated memory (the data area) or NULL on failure.
+ */
+void *alloc(size_t bytes)
+{
+    void *ptr = allocBlock(bytes);
+    recordCall(RecAlloc, bytes, ptr, 0);
+    profileAlloc(ptr, bytes);
+    return ptr;
+}
 
-    if (next_hdr_offset < Maxwords)
+/*
+ * Allocates `bytes` bytes at an address that is a multiple of `align`, e.g. 64 for a cache line or 4096 for a page.
+ * `align` must be a power of two; alignments up to ALLOC_ALIGN are what alloc() already guarantees.
+ * Stricter alignments are always served from the arenas, whatever the mmap threshold, so the padding is reusable heap memory.
+ * Returns pointer to allocated memory (the data area) or NULL with errno set (ErrInval for a bad alignment, ErrNoMem).
+ */
+void *alloc_aligned(size_t bytes, word align)
+{
+    if (align == 0 || (align & (align - 1)))
     {
-        if (!next_blocks_header->alloced)
-        {
-            // Check if the next block has a valid non-zero size (safety).
-            if (next_blocks_header->w > 0)
-            {
-                printf("free: Coalescing with next free block at %p (size %d words).\n", next_blocks_header, next_blocks_header->w);
+        trace(TraceErr, "alloc: Error: Alignment %lu is not a power of two.\n", align);
+        reterr(ErrInval);
+    }
 
-                hdr->w += next_blocks_header->w;
-                printf("free: Merged block size is now %d words.\n", hdr->w);
-            }
-            else
-            {
-                printf("free: Warning: Next block at %p has zero size. Skipping coalescing with it.\n", next_blocks_header);
-            }
-        }
-        else
+    void *ptr = align <= ALLOC_ALIGN ? allocBlock(bytes) : arenaAlloc(bytes, align, NULL);
+    recordCall(RecAligned, bytes, ptr, align);
+    profileAlloc(ptr, bytes);
+    return ptr;
+}
+
+/*
+ * Allocates `bytes` bytes from memory on NUMA node `node`, wherever the calling thread runs, e.g. for a buffer that a thread
+ * pinned to that node will use. Small requests come from the node's arenas, skipping the thread cache, whose blocks may be
+ * from any node; large ones get a mapping of their own bound to the node. The block is freed with freealloc() as usual.
+ * In builds without ALLOC_NUMA there is one node, 0, and this is alloc().
+ * Returns pointer to allocated memory (the data area) or NULL with errno set (ErrInval for a node that does not exist, ErrNoMem).
+ */
+void *alloc_on_node(size_t bytes, int32 node)
+{
+    if (node >= numaNodes())
+    {
+        trace(TraceErr, "alloc: Error: There is no NUMA node %u.\n", node);
+        reterr(ErrInval);
+    }
+
+    void *ptr;
+    if (bytes >= __atomic_load_n(&mmapthreshold, __ATOMIC_RELAXED))
+    {
+        ptr = bigAlloc(bytes);
+        if (ptr)
         {
-            printf("free: Next block at %p is allocated. Cannot coalesce forward.\n", next_blocks_header);
+            char *map = (char *)ptr - sizeof(header) - Bigprefix;
+            numaBind(map, *(size_t *)map, (word)node);
         }
     }
     else
+        ptr = homeAlloc(nodeArena((word)node), bytes, 0, NULL);
+
+    recordCall(RecAlloc, bytes, ptr, 0);
+    profileAlloc(ptr, bytes);
+    return ptr;
+}
+
+// Body of freealloc(), shared like allocBlock.
+static void freeBlock(void *ptr)
+{
+#if defined(ALLOC_HARDEN) && Quarantineslots
+    // The block takes a place in the quarantine, and the one it pushes out is what gets freed now.
+    if (ptr)
+        ptr = quarantineFree(ptr);
+    if (!ptr)
+        return;
+#elif defined(ALLOC_HARDEN)
+    if (ptr)
+        quarantineCheck(ptr, (header *)ptr - 1);
+#endif
+
+    // Directly mapped blocks go straight back to the OS without touching any arena.
+    if (ptr && bigFree((header *)ptr - 1))
+        return;
+
+#ifdef ALLOC_THREADS
+    if (ptr && remoteFree((header *)ptr - 1))
+        return;
+    if (ptr && tcacheFree((header *)ptr - 1))
+        return;
+#endif
+
+    // The owning arena is found from the address alone; freealloc_ still validates the pointer.
+    arena *a = arenaOf((header *)ptr - 1);
+
+    lockarena(a);
+    remoteDrain_(a);
+    freealloc_(ptr);
+    unlockarena(a);
+}
+
+/*
+ * Frees a block of memory previously allocated by alloc().
+ * Directly mapped large blocks are unmapped immediately.
+ * In thread-safe builds blocks of another thread's arena are queued for it without taking its lock (see remoteFree),
+ * small blocks go to the calling thread's cache, and only everything else takes the owning arena's lock.
+ */
+void freealloc(void *ptr)
+{
+    // Logged before the block is freed, so its address cannot show up in another thread's allocation first.
+    if (ptr)
+        recordCall(RecFree, 0, ptr, 0);
+    profileFree(ptr);
+    freeBlock(ptr);
+}
+
+/*
+ * Returns how many bytes the block `ptr` previously allocated by alloc() can hold, which is at least what was requested.
+ * The caller may use all of them, e.g. to let a container grow into the slack of its block before it calls realloc_block().
+ * Arena blocks are whole words and keep any remainder too small to split off; direct mappings are whole pages.
+ * Returns 0 for a NULL `ptr`, and 0 with errno set to ErrInval for a pointer that is not an allocated block.
+ * Pool slots are not valid here: they have no header, so whatever lies in front of one would be read as its size.
+ * Every slot of a pool holds the pool's slot size (see pool_create).
+ */
+size_t alloc_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+        return 0;
+
+    header *hdr = (header *)ptr - 1;
+
+    char *map = bigMapping(hdr);
+    if (map)
+        return *(size_t *)map - Bigprefix - sizeof(header);
+
+    // Only the owner of an allocated block changes its size, so it can be read without the arena lock.
+    if (!chunkOf(hdr) || !hdr->alloced)
     {
-        printf("free: No next block within bounds (offset %d >= %d). Cannot coalesce forward.\n", next_hdr_offset, Maxwords);
+        trace(TraceErr, "alloc: Error: Pointer %p is not an allocated block.\n", ptr);
+        errno = ErrInval;
+        return 0;
     }
 
-    printf("free: Free operation completed for pointer %p.\n", ptr);
-};
+    if (!sealed(hdr))
+        fatal("alloc: Error: Pointer %p (header %p) has a corrupted header.\n", ptr, hdr);
+
+    return hdr->w * Wordbytes - sizeof(header);
+}
 
 /*
- * Recursive function to find a free memory block of at least `words_to_alloc` words.
- * It searches the heap starting from `hdr`.
- * `hdr` is the current header of the block being inspected.
- * `n` is the offset in words from the *beginning* of the memory space (`memspace`).
- * Returns a pointer to the header of a suitable free block, or NULL if none is found.
-*/
-header *findBlock_(header *hdr, word words_to_alloc, word n)
+ * Frees the block `ptr`, which the caller knows was allocated with a request of `bytes` bytes (similar to C23 free_sized).
+ * Only blocks from alloc() are valid, and each carries a header that the free path reads anyway to coalesce the block,
+ * so the size does not save a lookup. In hardened mode it is checked against the header, so a mismatched sized delete,
+ * or a header overwritten with another plausible size, aborts instead of freeing the wrong amount of memory.
+ * Otherwise the size is not used and this is freealloc().
+ * Pool slots have no header and cannot be told from heap blocks by their address: they must go back through pool_free(),
+ * never through free_sized() or freealloc().
+ */
+void free_sized(void *ptr, size_t bytes)
 {
-    // Debug print to help diagnose the issue
-    printf("findBlock_: Looking at block at %p, size %d words, alloced=%d, n=%d, request=%d words\n", hdr, hdr->w, hdr->alloced, n, words_to_alloc);
+#ifdef ALLOC_HARDEN
+    if (ptr && bytes > alloc_usable_size(ptr))
+        fatal("free: Error: Pointer %p is freed as %zu bytes, but its block holds only %zu.\n", ptr, bytes, alloc_usable_size(ptr));
+#else
+    (void)bytes;
+#endif
 
-    // Check if we have reached or gone past the end of the valid memory space.
-    // If the current offset 'n' is greater than or equal to the total words available, there's no more space to search.
-    if ((n >= Maxwords - 2))
-    {
-        printf("findBlock_: Reached end of memory space (offset %d >= %d). No suitable block found.\n", n, Maxwords);
-        // Return NULL to indicate no block was found starting from this point.
+    freealloc(ptr);
+}
+
+// Body of calloc_block() once the size is known not to overflow.
+static void *zeroBlock(size_t bytes)
+{
+    if (bytes >= __atomic_load_n(&mmapthreshold, __ATOMIC_RELAXED))
+        return bigAlloc(bytes);
+
+    char *ptr;
+#ifdef ALLOC_THREADS
+    // Cached blocks have all been used before, and they are small, so clear them completely.
+    ptr = tcacheAlloc(wordsFor(bytes));
+    if (ptr)
+        return memset(ptr, 0, bytes);
+#endif
+
+    char *fresh;
+    ptr = arenaAlloc(bytes, 0, &fresh);
+    if (!ptr)
         return NULL;
-    }
 
-    // We need space for the requested data (`words_to_alloc`) PLUS the header (1 word).
-    word total_required_size = words_to_alloc + 1;
+    // Clear what was used before. The rest is zero, except the block's last word if it is the chunk's last word, which may hold a footer.
+    char *end = (char *)((header *)ptr - 1) + ((header *)ptr - 1)->w * Wordbytes;
+    memset(ptr, 0, fresh - ptr);
+    if (fresh < end)
+        memset(end - Wordbytes, 0, Wordbytes);
+
+    trace(TraceAll, "calloc: Cleared %zu of %zu bytes at %p.\n", (size_t)(fresh - ptr), (size_t)(end - ptr), (void *)ptr);
+    return ptr;
+}
 
-    // If current block is free AND large enough to satisfy our allocation request (data + header)
-    if (!hdr->alloced && hdr->w >= total_required_size)
+/*
+ * Allocates zeroed memory for `count` objects of `size` bytes each, like calloc.
+ * Memory that has never been part of an allocated block is still zero from the OS (memspace is .bss, chunks are fresh mappings),
+ * so only the part of the block that was used before is cleared; directly mapped blocks are not touched at all.
+ * Returns pointer to allocated memory (the data area) or NULL with errno set to ErrNoMem, also when `count * size` overflows.
+ */
+void *calloc_block(size_t count, size_t size)
+{
+    size_t bytes;
+    if (__builtin_mul_overflow(count, size, &bytes))
     {
-        printf("findBlock_: Found suitable block at %p, size %d words (requires %d words total)\n", hdr, hdr->w, total_required_size);
-        return hdr; // Found a suitable free block, return its header pointer
+        trace(TraceOps, "calloc: Request for %zu x %zu bytes overflows.\n", count, size);
+        reterr(ErrNoMem);
     }
 
-    // If the current block is not suitable (either allocated or too small), move to the next block.
+    trace(TraceOps, "calloc: Request for %zu bytes\n", bytes);
+
+    void *ptr = zeroBlock(bytes);
+    recordCall(RecCalloc, size, ptr, count);
+    profileAlloc(ptr, bytes);
+    return ptr;
+}
+
+/*
+ * Allocates `n` blocks of `size` bytes each, storing pointers to them in `out`.
+ * The batch is carved from one contiguous free block under a single lock (see allocBatch_);
+ * large sizes are mapped directly one by one, as alloc() would.
+ * Returns the number of blocks allocated, which is less than `n` (with errno set to ErrNoMem) only if the heap ran out.
+ */
+size_t alloc_batch(size_t size, size_t n, void **out)
+{
+    size_t done = 0;
+
+    if (size >= __atomic_load_n(&mmapthreshold, __ATOMIC_RELAXED))
+    {
+        while (done < n && (out[done] = bigAlloc(size)))
+            done++;
+    }
+    else
+    {
+        arena *home = threadArena();
+        for (word k = 0; done < n && k < Arenas; k++)
+        {
+            arena *a = &arenas[(home - arenas + k) % Arenas];
 
-    // Calculate the address of the next header.
-    // We move forward from the current header's address by the size of the current block (hdr->w), which is in words. Multiply by 4 because each word is 4 bytes.
-    header *next = (header *)((char *)hdr + hdr->w * 4);
+            lockarena(a);
+            done += allocBatch_(a, size, n - done, out + done);
+            unlockarena(a);
+        }
+    }
 
-    // Update our position tracking (offset in words from the beginning).
-    // The next block starts after the current block, so add the current block's size to the current offset.
-    word n_ = n + hdr->w;
+    for (size_t i = 0; i < done; i++)
+    {
+        recordCall(RecAlloc, size, out[i], 0);
+        profileAlloc(out[i], size);
+    }
 
-    printf("findBlock_: Moving to next block at %p, new offset %d words\n", next, n_);
+    if (done < n)
+        errno = ErrNoMem;
+    return done;
+}
 
-    // Recursively continue the search with the next block's header and the updated offset.
-    return findBlock_(next, words_to_alloc, n_);
+// Orders pointers by address, for free_batch.
+static int byAddress(const void *x, const void *y)
+{
+    size_t p = (size_t)*(void *const *)x, q = (size_t)*(void *const *)y;
+    return (p > q) - (p < q);
 }
 
 /*
- * Allocates a block of memory in the heap with `words_to_alloc` 4-byte units.
- * `hdr` is the header of the *found* free block that is large enough.
- * Returns a pointer to the usable memory (after the header).
- * Implements block splitting for efficient memory usage when the found block is larger than needed.
-*/
-
-void *mkalloc(word words_to_alloc, header *hdr)
+ * Frees the `n` blocks in `ptrs`, which may come from any mix of arenas, chunks and direct mappings.
+ * The array is sorted by address, so that blocks of the same arena are freed under one lock and blocks that are
+ * adjacent in the heap are joined first and then freed (validated, coalesced and binned) as a single block.
+ * The blocks go straight to the heap, bypassing the thread cache; one that is still in it or in a fast bin was freed already
+ * and is skipped, and never joined with its neighbours.
+ * In hardened mode each block instead takes freealloc()'s path, through the double-free checks and the quarantine,
+ * so a batch is never joined. NULL entries are ignored.
+ */
+void free_batch(void **ptrs, size_t n)
 {
-    // Calculate how many words into the memspace this header is located.
-    // This is mainly for debugging output to show the block's position.
-    word wordsin = ((char *)hdr - (char *)memspace) / 4;
+    arena *held = NULL;
 
-    // Calculate the total size needed for the allocated block (data + header).
-    word total_required_size = words_to_alloc + 1;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (ptrs[i])
+            recordCall(RecFree, 0, ptrs[i], 0);
+        profileFree(ptrs[i]);
+    }
 
-    printf("mkalloc: Attempting to allocate %d words (data + header) at offset %d words (%p)\n", total_required_size, wordsin, hdr);
+#ifdef ALLOC_HARDEN
+    for (size_t i = 0; i < n; i++)
+        freeBlock(ptrs[i]);
+    return;
+#endif
 
-    // Get the original total size of the found free block.
-    word original_size = hdr->w; // Size includes its own header
+#ifdef ALLOC_THREADS
+    // Freeing a cached block to the heap as well would let it be handed out twice.
+    for (size_t i = 0; i < n; i++)
+    {
+        header *hdr = (header *)ptrs[i] - 1;
+        if (ptrs[i] && chunkOf(hdr) && hdr->alloced && tcacheHolds(tcacheBin(hdr->w), hdr))
+        {
+            trace(TraceErr, "free: Error: Pointer %p (header %p) is already free (thread cache).\n", ptrs[i], hdr);
+            ptrs[i] = NULL;
+        }
+    }
+#endif
 
-    // If the original block is larger than what's required by at least 2 words, we can split it.
-    // We need at least 1 word for the remainder's header + 1 word for minimum data or padding to make a valid new free block.
-    if ((original_size - total_required_size) >= 2)
+    qsort(ptrs, n, sizeof(void *), byAddress);
+
+    for (size_t i = 0; i < n;)
     {
-        printf("mkalloc: Splitting block - original size %d words, allocating %d words, remainder size %d words.\n", original_size, total_required_size, original_size - total_required_size);
+        void *ptr = ptrs[i++];
+        if (ptr == NULL)
+            continue;
 
-        // Calculate the address for the header of the new free block (the remainder). It starts immediately after the allocated portion
-        header *next_hdr = (header *)((char *)hdr + total_required_size * 4);
+        header *hdr = (header *)ptr - 1;
+        if (bigFree(hdr))
+            continue;
 
-        // Set the size of the new free block.
-        next_hdr->w = original_size - total_required_size;
-        next_hdr->alloced = false; // Mark the remainder block as free.
-        printf("mkalloc: Created new free block (remainder) at %p, size %d words.\n", next_hdr, next_hdr->w);
+        chunk *c = chunkOf(hdr);
+        arena *a = c ? c->owner : &arenas[0];
+        if (a != held)
+        {
+            if (held)
+                unlockarena(held);
+            lockarena(a);
+            held = a;
+        }
 
-        // Update the size of the block being allocated to reflect only the allocated portion.
-        hdr->w = total_required_size;
+        // Parked blocks are still marked allocated; joined with a neighbour, one would be freed while still in its fast bin.
+        if (c && hdr->alloced && hdr->w && fastParked_(a, hdr))
+        {
+            trace(TraceErr, "free: Error: Pointer %p (header %p) is already free (fast bin).\n", ptr, hdr);
+            continue;
+        }
+
+        // Absorb the allocated blocks right after this one that are also in the batch; freealloc_ then frees them all at once.
+        // A parked block stops the run, and is reported when its turn comes.
+        if (c && hdr->alloced && hdr->w)
+        {
+            header *next = (header *)((char *)hdr + hdr->w * Wordbytes);
+            while (i < n && ptrs[i] == (void *)(next + 1) && next->alloced && next->w && !fastParked_(a, next))
+            {
+                trace(TraceAll, "free: Joining batched block at %p with next batched block at %p.\n", hdr, next);
+                if (a->rover == next)
+                    a->rover = hdr;
+                hdr->w += next->w;
+                statAdd(a, allocblocks, -1);
+                next = (header *)((char *)hdr + hdr->w * Wordbytes);
+                i++;
+            }
+        }
+
+        freealloc_(ptr);
     }
-    // If the remainder is too small to split, we just allocate the entire block found by findBlock_.
-    // In this case, hdr->w remains original_size, and no new free block is created after it.
-    // This path is taken if (original_size - total_required_size) < 2.
-    // Mark the block as allocated.
-    hdr->alloced = true;
 
-    printf("mkalloc: Marked block at %p as allocated, size %d words (data portion %d words).\n", hdr, hdr->w, words_to_alloc);
-    // Return a pointer to the usable memory area, which is immediately *after* the header.
-    // Pointer arithmetic 'hdr + 1' automatically moves the pointer by the size of 'header'.
-    return (void *)(hdr + 1);
+    if (held)
+        unlockarena(held);
 }
 
-/*
- * Top-level malloc-like function. Tries to allocate a block of `bytes` size.
- * Rounds the requested size up to the nearest word size.
- * Handles the initial heap setup on the first allocation.
- * Finds a suitable free block using findBlock and marks it as allocated using mkalloc.
- * Returns pointer to allocated memory (the data area) or NULL on failure.
-*/
-void *alloc(int32 bytes)
+// Body of realloc_block() for a block and a non-zero size.
+static void *reallocBlock(void *ptr, size_t new_bytes)
 {
-    word words;
-    header *hdr = (header *)memspace; // Pointer to the very first header in the heap.
+    header *hdr = (header *)ptr - 1;
+    trace(TraceOps, "realloc: Resizing %p to %zu bytes\n", ptr, new_bytes);
 
-    // Calculate the number of words needed for the data. Round up to the nearest word (4 bytes).
-    // The expression `(bytes + 3) / 4` performs integer division equivalent to ceil(bytes / 4.0).
-    words = (bytes + 3) / 4;
+#ifdef ALLOC_HARDEN
+    quarantineCheck(ptr, hdr);
+#endif
 
-    printf("alloc: Request for %d bytes (%d words)\n", bytes, words);
+    char *map = bigMapping(hdr);
+    if (map)
+        return bigRealloc(map, new_bytes);
 
-    // Check if the heap is uninitialized. We use the size field of the first header as an indicator.
-    // If hdr->w is 0, it implies the memory block is in its zero-initialized state from .bss.
-    if (hdr->w == 0)
+    chunk *c = chunkOf(hdr);
+    if (!c || !hdr->alloced || hdr->w == 0)
     {
-        printf("alloc: First allocation detected - initializing heap metadata.\n");
-        // For the very first allocation, we need enough space for the requested data words
-        // PLUS the header word (1). Check if this exceeds the total heap capacity.
-        if (words + 1 > Maxwords)
-        {
-            printf("alloc: Initial allocation request (%d words data + 1 header = %d total) exceeds total heap size (%d words).\n", words, words + 1, Maxwords);
+        trace(TraceErr, "realloc: Error: Invalid pointer %p (header %p) - not an allocated heap block.\n", ptr, hdr);
+        reterr(ErrInval);
+    }
 
-            reterr(ErrNoMem); // Set errno to indicate out of memory and return NULL.
-        }
+    // Only the owner of an allocated block can resize it, so its size can be read before taking the lock.
+    size_t old_bytes = (hdr->w - 1) * Wordbytes;
+
+    // Large targets are better served by a mapping of their own than by growing inside a chunk.
+    if (new_bytes < __atomic_load_n(&mmapthreshold, __ATOMIC_RELAXED))
+    {
+        arena *a = c->owner;
+
+        word words = wordsFor(new_bytes);
+        if (!words)
+            return NULL;
 
-        // Initialize the first block's header to represent the entire heap as one large free block.
-        // The size of this initial block is the total heap size in words.
-        hdr->w = Maxwords;
-        hdr->alloced = false; // The entire heap is initially free.
+        lockarena(a);
+        bool resized = resize_(a, hdr, words);
+        unlockarena(a);
 
-        printf("alloc: Initialized heap first block with size %d words.\n", hdr->w);
+        if (resized)
+            return ptr;
     }
 
-    // Find a suitable free block in the heap.
-    // We start the search from the beginning of the heap (`memspace`).
-    // The `findBlock` macro calls `findBlock_` with the correct starting address and offset 0.
-    // We pass the number of words requested for *data* (`words`).
-    // FIX: Corrected the parameters passed to the findBlock macro call.
-    header *found = findBlock(words, 0);
+    void *moved = allocBlock(new_bytes);
+    if (!moved)
+        return NULL;
 
-    // If findBlock returns NULL, it means no suitable free block large enough was found in the heap.
+    trace(TraceAll, "realloc: Moving %p to %p.\n", ptr, moved);
+    memcpy(moved, ptr, old_bytes < new_bytes ? old_bytes : new_bytes);
+    freeBlock(ptr);
 
-    if (!found)
+    return moved;
+}
+
+/*
+ * Resizes the block `ptr` previously allocated by alloc() to hold `new_bytes` bytes, like realloc.
+ * The block is resized in place whenever it can be (see resize_ and bigRealloc), and only moved with a copy as a last resort.
+ * A NULL `ptr` allocates a new block; a `new_bytes` of 0 frees `ptr` and returns NULL.
+ * A moved block only keeps alloc()'s default alignment, even if it came from alloc_aligned().
+ * Returns pointer to the resized block, or NULL with errno set (ErrInval for an invalid pointer, ErrNoMem); `ptr` is then still valid.
+ */
+void *realloc_block(void *ptr, size_t new_bytes)
+{
+    if (ptr == NULL)
+        return alloc(new_bytes);
+
+    if (new_bytes == 0)
     {
-        printf("alloc: No suitable free block found for %d words (including header).\n", words + 1);
-        // findBlock_ doesn't set errno for not finding a block, so we set it here.
-        errno = ErrNoMem;
+        freealloc(ptr);
         return NULL;
     }
 
-    // Mark the found block as allocated and handle potential splitting if it's larger than needed.
-    // mkalloc takes the requested *data* size in words and the header of the found block.
-    return mkalloc(words, found);
+    // The profiler counts a resize as a free and a new allocation, so a sampled block whose resize fails drops out of the profile.
+    int64 pos = recordOpen();
+    profileFree(ptr);
+    void *resized = reallocBlock(ptr, new_bytes);
+    recordClose(pos, RecRealloc, new_bytes, resized, ptr);
+    profileAlloc(resized, new_bytes);
+    return resized;
+}
+
+#ifdef ALLOC_STATS
+/*
+ * Fills `out` with the allocator's counters (see struct s_allocstats), without walking the heap.
+ * Each arena is locked only to free the blocks other threads queued for it, copy its counters, count its released pages and find its largest free block, which takes a walk down the right edge of its size tree, or of its largest non-empty bin if the tree is empty.
+ * The thread counters are read as they are, without stopping the threads that update them.
+ */
+void alloc_stats(allocstats *out)
+{
+    memset(out, 0, sizeof(*out));
+
+    for (word i = 0; i < Arenas; i++)
+    {
+        arena *a = &arenas[i];
+
+        lockarena(a);
+        remoteDrain_(a);
+        out->allocbytes += a->stats.allocbytes;
+        out->allocblocks += a->stats.allocblocks;
+        out->freebytes += a->stats.freebytes;
+        out->freeblocks += a->stats.freeblocks;
+        out->splits += a->stats.splits;
+        out->coalesces += a->stats.coalesces;
+        for (word k = 0; k < Probebuckets; k++)
+            out->searches[k] += a->stats.searches[k];
+        for (chunk *c = a->tail ? &a->first : NULL; c; c = c->next)
+            out->releasedbytes += c->released * (size_t)sysconf(_SC_PAGESIZE);
+#ifdef ALLOC_DEFER
+        // Like cached blocks, parked blocks are still allocated to their arena.
+        out->deferredbytes += a->fastwords * Wordbytes;
+        out->deferredblocks += a->fastblocks;
+        out->allocbytes -= a->fastwords * Wordbytes;
+        out->allocblocks -= a->fastblocks;
+#endif
+
+        // The largest free block is the last one in the size tree, or else somewhere in the top populated bin.
+        if (a->tree)
+        {
+            header *hdr = a->tree;
+            while (nodeof(hdr)->child[1])
+                hdr = nodeof(hdr)->child[1];
+            if (hdr->w * Wordbytes > out->largestfree)
+                out->largestfree = hdr->w * Wordbytes;
+        }
+        else if (a->binmap)
+        {
+            for (header *hdr = a->bins[binIndex(a->binmap)]; hdr; hdr = linksof(hdr)->next)
+            {
+                if (hdr->w * Wordbytes > out->largestfree)
+                    out->largestfree = hdr->w * Wordbytes;
+            }
+        }
+        unlockarena(a);
+    }
+
+    struct s_threadstats sum = {0};
+#ifdef ALLOC_THREADS
+    pthread_mutex_lock(&statslock);
+    statsSum(&sum, &retired);
+    for (struct s_threadstats *s = statthreads; s; s = s->next)
+        statsSum(&sum, s);
+    pthread_mutex_unlock(&statslock);
+#else
+    statsSum(&sum, &mystats);
+#endif
+
+    // The arenas count blocks sitting in thread caches as allocated; to the program they are free.
+    out->cachedbytes = sum.cachedbytes;
+    out->cachedblocks = sum.cachedblocks;
+    out->mappedbytes = sum.mappedbytes;
+    out->mappedblocks = sum.mappedblocks;
+    out->allocbytes += sum.mappedbytes - sum.cachedbytes;
+    out->allocblocks += sum.mappedblocks - sum.cachedblocks;
+
+    out->fragmentation = out->freebytes ? 1.0 - (double)out->largestfree / out->freebytes : 0.0;
 }
+#endif
 
 /*
  * Simple function to print the current memory layout
  */
 void print_memory_layout()
 {
-    header *current = (header *)memspace;
-    word offset = 0;
-
     printf("\n==== MEMORY LAYOUT ====\n");
 
-    while (offset < Maxwords)
+    for (word i = 0; i < Arenas; i++)
     {
-        printf("Block at %p (offset %d words): size=%d words, %s\n",
-               current, offset, current->w,
-               current->alloced ? "ALLOCATED" : "FREE");
+        arena *a = &arenas[i];
 
-        if (current->w == 0)
-        {
-            printf("  Warning: Zero-sized block detected! Layout may be corrupted.\n");
-            break;
-        }
+        if (Arenas > 1)
+            printf("Arena %lu (offset %lu-%lu words):\n", i, arenaStart(i), arenaEnd(i));
 
-        offset += current->w;
-        current = (header *)((char *)current + current->w * 4);
+        lockarena(a);
 
-        if (offset >= Maxwords)
+        // An arena that has never been used has no chunk list yet; show its untouched slice of memspace.
+        chunk untouched = {.base = arenaBase(i), .words = arenaWords(i)};
+
+        for (chunk *c = a->tail ? &a->first : &untouched; c; c = c->next)
         {
-            break;
+            header *current = c->base;
+            word offset = 0;
+
+            if (c != &a->first && c != &untouched)
+                printf("Chunk at %p (%lu words, mapped):\n", (void *)c, c->words);
+
+            while (offset < c->words)
+            {
+                printf("Block at %p (offset %lu words): size=%lu words, %s\n",
+                       current, offset, (word)current->w,
+                       current->alloced ? "ALLOCATED" : "FREE");
+
+                if (current->w == 0)
+                {
+                    printf("  Warning: Zero-sized block detected! Layout may be corrupted.\n");
+                    break;
+                }
+
+                offset += current->w;
+                current = (header *)((char *)current + current->w * Wordbytes);
+            }
         }
+
+        unlockarena(a);
     }
 
     printf("=======================\n\n");
 }
 
+#ifndef ALLOC_NO_DEMO
 /*
  * Entry point: test the allocator
  * Demonstrates basic usage of the allocation system
+ * Left out with -DALLOC_NO_DEMO when the allocator is linked into another program (see the bench target).
  */
 int main(int unused argc, char **unused argv)
 {
     printf("Starting memory allocator test\n");
-    printf("Heap size: %d words (%d bytes)\n", Maxwords, Maxwords * 4);
+    printf("Heap size: %lu words (%lu bytes)\n", Maxwords, Maxwords * Wordbytes);
 
     // Print initial memory layout
     print_memory_layout();
@@ -364,8 +3286,8 @@ int main(int unused argc, char **unused argv)
     }
 
     // Print layout after freeing the second block.
-    // Forward coalescing SHOULD happen here, merging the block freed by ptr2
-    // with the large free block that followed it.
+    // Coalescing SHOULD happen in both directions here, merging the block freed by ptr2
+    // with the free block before it (ptr) and the large free block that followed it.
     print_memory_layout();
 
     // --- Diagnostic Information ---
@@ -373,4 +3295,5 @@ int main(int unused argc, char **unused argv)
     printf("memspace base address:%p\n", (void *)memspace); // Address of the start of the heap.
 
     return 0; // Indicate successful program execution by returning 0 from main.
-}
\ No newline at end of file
+}
+#endif
@@ -2,23 +2,48 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <errno.h>
+#include <sys/mman.h>
+
+#ifdef ALLOC_THREADS
+#include <pthread.h>
+#endif
 
 // Compiler attributes for optimizing code and providing metadata
 #define packed __attribute__((__packed__)) // Ensures structure has no padding between fields. Important for bitfields to occupy exact size.
 #define unused __attribute__((__unused__)) // Silences compiler warnings for unused parameters. Useful in main function signature for unused argc/argv.
 
-// Define maximum heap size: just under 1MB of 4-byte words
-// We define the size in terms of 4-byte words because our allocator operates on word-sized units.
+// Size in bytes of the static heap region (memspace) reserved in heap.asm; the heap grows beyond it with mapped chunks.
+// Must match the value heap.asm is assembled with (-DHeapbytes=N for both, or `make HEAP=N`).
+#ifndef Heapbytes
+#define Heapbytes (1024 * 1024)
+#endif
+
+// Define maximum heap size: just under Heapbytes, in words
+// We define the size in terms of words because our allocator operates on word-sized units.
 // Maxwords represents the total capacity of our heap area in words.
-#define Maxwords ((1024 * 1024 / 4) - 1) // 1 MB is 1024*1024 bytes. Divided by 4 gives words. Subtracting 1 word might be for alignment or just a design choice.
+#define Maxwords ((word)(Heapbytes / Wordbytes) - 1) // The last word is kept for the epilogue header that ends the heap.
 
 // Error codes used by the allocator
 #define ErrNoMem 1 // Indicates that an allocation request could not be fulfilled due to lack of available memory.
 #define ErrUnknown 2 // A generic or unhandled error condition.
+#define ErrInval 3 // An allocator API was called with an invalid argument.
+
+// Block search policies used by alloc() to pick a free block.
+// The default can be chosen at build time (e.g. -DALLOC_POLICY=FitNext) and changed at runtime with setpolicy().
+#define FitBins 0  // Segregated size-class free lists (close to O(1)).
+#define FitFirst 1 // First free block that fits, walking from the start of memspace.
+#define FitNext 2  // First free block that fits, walking from a roving cursor kept across calls.
+#define FitBest 3  // Smallest free block that fits, from the bins and the size tree; stops early on an exact fit.
+#define FitMap 4   // First free block that fits, found by scanning the chunks' freemaps a word at a time (needs ALLOC_FREEMAP).
+
+#ifndef ALLOC_POLICY
+#define ALLOC_POLICY FitBins
+#endif
 
 // Type definitions for clarity and portability
 typedef unsigned char int8;           // 8-bit unsigned integer
@@ -26,22 +51,288 @@ typedef unsigned short int int16;     // 16-bit unsigned integer
 typedef unsigned int int32;           // 32-bit unsigned integer
 typedef unsigned long long int int64; // 64-bit unsigned integer
 typedef void heap;                    // Type to represent the abstract heap memory area. Used as a pointer type.
-typedef int32 word;                   // A "word" is our basic 4-byte allocation unit. Defined as int32 for clarity.
+typedef unsigned long word;           // A "word" is our basic allocation unit: the machine word, 4 bytes in 32-bit builds and 8 in 64-bit builds.
 
-// Header format: 30 bits size, 1 bit allocated flag, 1 bit reserved
+#define Wordbytes ((word)sizeof(word)) // Bytes per word.
+#define Wordbits (8 * sizeof(word))    // Bits per word.
+
+// Hardened mode (-DALLOC_HARDEN, or `make HARDEN=1`) takes this many bits of every header for a checksum (see seal in main.c),
+// which leaves 22-bit sizes (blocks up to 16 MB) in 32-bit builds and 46-bit sizes in 64-bit builds.
+#ifdef ALLOC_HARDEN
+#define Checkbits (Wordbits == 32 ? 8 : 16)
+#else
+#define Checkbits 0
+#endif
+
+// Header format: one word holding the size in all but the top 2 bits, 1 bit allocated flag, 1 bit previous-block-is-free flag
 // This structure defines the metadata for each block of memory in the heap.
-// Using bitfields allows us to pack this information efficiently into a single 4-byte word.
+// Using bitfields allows us to pack this information efficiently into a single word.
+// In 32-bit builds that is a 30-bit size (blocks up to 4 GB); 64-bit builds get a 62-bit size, so no block or heap size is out of reach.
 struct packed s_header
 {
-    word w : 30; // Size of the block *including* the header itself, in 4-byte words. 30 bits allows for a maximum size of 2^30 words, which is sufficient for a 1GB heap.
+    word w : Wordbits - 2 - Checkbits; // Size of the block *including* the header itself, in words.
+
+#ifdef ALLOC_HARDEN
+    word check : Checkbits; // Checksum of the header's address, size and allocated bit, keyed by a random cookie.
+#endif
 
     bool alloced : 1; // Flag indicating if the block is currently allocated (true/1) or free (false/0).
 
-    bool reserved : 1; // A reserved bit, currently unused. Could be used for future features like boundary tags.
+    bool prevfree : 1; // Boundary tag: set when the block immediately before this one is free. Its size is then in the word just before this header (its footer).
 };
 
 typedef struct packed s_header header; // Alias the struct type to 'header' for convenience.
 
+// Free-list links stored in the payload of every FREE block.
+// A free block's data area is unused, so we thread the segregated free lists through it instead of walking every header in memspace to find space.
+struct s_links
+{
+    header *next; // Next free block in the same size-class bin (NULL at the end of the list).
+    header *prev; // Previous free block in the same size-class bin (NULL at the head of the list).
+};
+
+typedef struct s_links links;
+
+// Returns the free-list links of a free block, which live immediately after its header.
+#define linksof(hdr) ((links *)((header *)(hdr) + 1))
+
+// Size-tree node stored in the payload of every free block of Treewords words or more, in place of its links.
+// The tree is a red-black tree ordered by size and then by address, so a best fit is found in O(log n).
+struct s_node
+{
+    header *child[2]; // Blocks ordered before (child[0]) and after (child[1]) this one.
+    header *parent;   // Parent node (NULL at the root).
+    word red;         // Colour of the node: 1 red, 0 black.
+};
+
+typedef struct s_node node;
+
+// Returns the size-tree node of a large free block, which lives immediately after its header.
+#define nodeof(hdr) ((node *)((header *)(hdr) + 1))
+
+// Alignment in bytes of every pointer alloc() returns (-DALLOC_ALIGN=16, or `make ALIGN=16`). A power of two, at least 8 and at least a word.
+// The default is two words: 8 bytes in 32-bit builds and 16 in 64-bit builds, as for malloc.
+// Every block size is a multiple of it and every chunk's first header sits just before an aligned address,
+// so each header is followed by an aligned payload.
+#ifndef ALLOC_ALIGN
+#define ALLOC_ALIGN (2 * Wordbytes)
+#endif
+
+// Block sizes are multiples of this many words.
+#define Alignwords ((word)(ALLOC_ALIGN / Wordbytes))
+
+// Rounds a size in words up to a multiple of Alignwords.
+#define alignWords(w) (((w) + Alignwords - 1) & ~(Alignwords - 1))
+
+// First header at or after address `p` whose payload is ALLOC_ALIGN-aligned.
+#define alignHeader(p) ((header *)((((size_t)(p) + sizeof(header) + ALLOC_ALIGN - 1) & ~(size_t)(ALLOC_ALIGN - 1)) - sizeof(header)))
+
+// Smallest block (in words, header included) the allocator will ever create.
+// Every block must be able to hold its free-list links and its footer once it is freed,
+// so this is the header, two pointers rounded up to whole words, and one footer word, rounded up to the alignment.
+#define Minwords ((word)alignWords(1 + (sizeof(links) + Wordbytes - 1) / Wordbytes + 1))
+
+// Number of segregated free-list bins.
+// Bin k holds free blocks whose size in words lies in [2^k, 2^(k+1)).
+// Larger blocks vary too much in size for a list to find a good fit quickly, so they go into the arena's size tree instead.
+#define Bins 8
+#define Treewords ((word)1 << Bins) // Smallest block kept in the size tree.
+
+// Thread-safe mode (-DALLOC_THREADS, or `make THREADS=1`).
+// Each arena of the shared heap is protected by its own lock, and each thread keeps a small cache of freed blocks in front of it.
+#ifdef ALLOC_THREADS
+#define threadlocal __thread
+#define lockarena(a) pthread_mutex_lock(&(a)->lock)
+#define unlockarena(a) pthread_mutex_unlock(&(a)->lock)
+#else
+#define threadlocal
+#define lockarena(a) ((void)(a))
+#define unlockarena(a) ((void)(a))
+#endif
+
+// Number of arenas memspace is split into (-DArenas=N, or `make ARENAS=N`).
+// Each arena is an independent sub-heap with its own blocks, free lists and lock; threads are assigned to arenas round-robin.
+#ifndef Arenas
+#define Arenas 1
+#endif
+
+// Words of memspace owned by each arena, including the one-word epilogue header that ends it.
+// With a single arena this is the whole of memspace: Maxwords words of blocks plus the epilogue in the last word.
+#define Arenawords ((Maxwords + 1) / Arenas)
+
+// Word offsets from memspace of the first block of arena `i` and of its epilogue header.
+// Blocks of arena `i` tile [arenaStart(i), arenaEnd(i)); the last arena absorbs the rounding remainder.
+#define arenaStart(i) ((word)(i) * Arenawords)
+#define arenaEnd(i) ((word)(i) == Arenas - 1 ? (word)Maxwords : ((word)(i) + 1) * Arenawords - 1)
+
+// Header of the first block of arena `i`, and the words of blocks that fit between it and the arena's end.
+// The first header is moved up to the alignment, and the epilogue comes right after the last whole aligned block.
+#define arenaBase(i) alignHeader(memspace + arenaStart(i) * Wordbytes)
+#define arenaWords(i) ((word)((memspace + arenaEnd(i) * Wordbytes - (char *)arenaBase(i)) / Wordbytes) & ~(Alignwords - 1))
+
+// Largest block size the 'w' field can describe, and therefore the largest chunk we ever map.
+#define Maxblockwords ((word)(((word)1 << (Wordbits - 2 - Checkbits)) - 1))
+
+// Requests of at least this many bytes bypass the arenas and get a mapping of their own, which freealloc() unmaps right away.
+// Can be changed at runtime with setmmapthreshold().
+#ifndef ALLOC_MMAP_THRESHOLD
+#define ALLOC_MMAP_THRESHOLD (128 * 1024)
+#endif
+
+// Bytes in front of the header of a directly mapped block: the length of its mapping, padded so the payload is aligned.
+#define Bigprefix (((sizeof(size_t) + sizeof(header) + ALLOC_ALIGN - 1) & ~(size_t)(ALLOC_ALIGN - 1)) - sizeof(header))
+
+// A directly mapped block's header is tagged with size 0 and the allocated bit, like an epilogue.
+#define isBig(hdr) ((hdr)->w == 0 && (hdr)->alloced)
+
+// Hugepage backing (-DALLOC_HUGEPAGES=1 or 2, or `make HUGEPAGES=1`): mapped chunks are sized and aligned in whole hugepages
+// and the memspace slices are advised to use them, which cuts TLB misses on large heaps. 1 uses transparent hugepages;
+// 2 first tries explicit ones from the hugetlbfs pool (MAP_HUGETLB). Without either, the heap falls back to normal pages with a warning.
+#ifndef Hugepage
+#define Hugepage ((size_t)2 * 1024 * 1024)
+#endif
+
+// NUMA placement (-DALLOC_NUMA, or `make NUMA=1`): arena i keeps its memory on node i % nodes, and threads allocate from an
+// arena of the node they run on. Build with at least as many arenas as nodes. A thread checks its node again every Numarecheck calls.
+#ifndef Numarecheck
+#define Numarecheck 4096
+#endif
+
+// Most chunks obtained from mmap that can be live at once, across all arenas.
+// Chunks grow geometrically, so this is far more than any heap needs.
+#define Maxchunks 256
+
+typedef struct s_arena arena;
+
+// A contiguous run of blocks ending in an epilogue header (a zero-sized block that is never free).
+// Every arena starts with its slice of memspace as its first chunk, and grows by mapping more chunks from the OS when it runs out.
+// A mapped chunk keeps this descriptor at the start of the mapping, with its first block right after it.
+struct s_chunk
+{
+    struct s_chunk *next; // Next chunk of the same arena (NULL for the last one).
+    struct s_chunk *prev; // Previous chunk of the same arena (NULL for the first one).
+    header *base;         // Header of the chunk's first block.
+    word words;           // Words of blocks in the chunk; the epilogue header sits right after them.
+    size_t bytes;         // Length of the mapping for chunks from mmap (0 for the memspace slice).
+    arena *owner;         // Arena whose free lists and lock cover this chunk.
+    char *clean;          // High-water mark: memory from here up has never been part of an allocated block,
+                          // so it is still zero apart from the chunk's last word (the footer of a free block that reaches it).
+#ifdef ALLOC_FREEMAP
+    word *freemap;        // Bit g is set while the g-th granule of Alignwords words of the chunk lies in a free block.
+#endif
+    word *pagemap;        // Bit p is set while the p-th page from the one holding `base` is released to the OS (see alloc_trim).
+    word released;        // Number of set bits in pagemap.
+#ifdef ALLOC_HUGEPAGES
+    bool hugetlb;         // Mapped from explicit hugepages, which cannot be released a normal page at a time.
+#endif
+};
+
+typedef struct s_chunk chunk;
+
+// Free-space bitmap (-DALLOC_FREEMAP, or `make FREEMAP=1`): every chunk keeps one bit per granule of Alignwords words,
+// set while the granule is part of a free block. Free blocks never touch, so each run of set bits is exactly one free block,
+// and FitMap finds one large enough by skipping whole words of allocated granules instead of visiting every header.
+// Bytes of freemap needed for a chunk of `words` words.
+#define mapBytes(words) (((words) / Alignwords / Wordbits + 1) * Wordbytes)
+
+// Trimming (see trim.c): pages that lie entirely inside a free block are handed back to the OS with madvise(Trimadvice),
+// and every chunk keeps a page map recording which of its pages are released until an allocation reaches them again.
+// MADV_DONTNEED drops the pages at once; -DTrimadvice=MADV_FREE lets the kernel take them only under memory pressure.
+#ifndef Trimadvice
+#define Trimadvice MADV_DONTNEED
+#endif
+
+// Milliseconds between two trims of the background trimmer unless alloc_trim_start() is given a period.
+#define Trimperiod 1000
+
+// Smallest page size trimming supports; the page maps of the memspace slices are sized for it.
+#define Minpage 4096
+
+// Bytes of page map needed for a chunk of `words` words with pages of `page` bytes (its blocks may straddle one more page at each end).
+#define pagemapBytes(words, page) ((((size_t)(words) * Wordbytes / (page) + 2) / Wordbits + 1) * Wordbytes)
+
+// Index in chunk `c`'s page map of the page holding address `p`.
+#define pageIn(c, p, page) ((word)((size_t)(p) / (page) - (size_t)(c)->base / (page)))
+
+// Returns the header `off` words into chunk `c`.
+#define blockAt(c, off) ((header *)((word *)(c)->base + (off)))
+
+// Word offset of header `hdr` from the start of chunk `c`.
+#define offsetIn(c, hdr) ((word)(((char *)(hdr) - (char *)(c)->base) / Wordbytes))
+
+// Allocator statistics (-DALLOC_STATS, or `make STATS=1`), read with alloc_stats().
+// Counters are kept up to date as the heap changes, so reading them never walks the heap.
+// Buckets of the search length histogram: searches that inspected 0 blocks, 1, 2-3, 4-7, ..., and 2^(Probebuckets-2) or more.
+#define Probebuckets 16
+
+// Counters of one arena, updated under its lock alongside the blocks they describe.
+struct s_arenastats
+{
+    size_t allocbytes;   // Bytes in blocks the arena has handed out, headers included (blocks in thread caches too).
+    size_t allocblocks;  // Number of those blocks.
+    size_t freebytes;    // Bytes in the arena's free blocks, headers included.
+    size_t freeblocks;   // Number of free blocks (every one of them is on the free lists).
+    size_t splits;       // Free blocks split into an allocated block and a free remainder.
+    size_t coalesces;    // Free blocks merged with a free neighbour.
+    size_t searches[Probebuckets]; // Block searches by the number of blocks they inspected.
+};
+
+typedef struct s_arenastats arenastats;
+
+#ifdef ALLOC_STATS
+#define statAdd(a, field, n) ((a)->stats.field += (n))
+#else
+#define statAdd(a, field, n) ((void)(a), (void)(n))
+#endif
+
+// Deferred coalescing (-DALLOC_DEFER, or `make DEFER=1`): small freed blocks wait unmerged in per-arena fast bins.
+// Fast bin i holds blocks of Minwords + i * Alignwords words; the arena consolidates them once they hold over Fastlimit bytes.
+#define Fastbins 16
+#ifndef Fastlimit
+#define Fastlimit (64 * 1024)
+#endif
+
+// Fast bin for blocks of `w` words; at least Fastbins for sizes that are always coalesced right away.
+#define fastBin(w) (((w) - Minwords) / Alignwords)
+
+// An independently locked sub-heap: a slice of memspace with its own block chain and free lists,
+// plus any chunks mapped from the OS when that slice fills up.
+struct s_arena
+{
+    header *bins[Bins]; // Heads of the segregated free lists, one per size class.
+    word binmap;        // Bit k is set when bins[k] is non-empty, so binFind can skip empty size classes.
+    header *tree;       // Root of the size tree of free blocks too large for the bins (NULL when there are none).
+    header *rover;      // FitNext cursor: where the previous next-fit search succeeded (NULL until the first search).
+    chunk *roverchunk;  // Chunk the FitNext cursor is in.
+    chunk first;        // The arena's slice of memspace; always the head of its chunk list.
+    chunk *tail;        // Last chunk of the arena; new chunks are linked after it.
+    word words;         // Words of blocks across all of the arena's chunks, which sizes the next chunk.
+    char *fresh;        // Where the never-used part of the block mkalloc handed out last begins (its end if there is none).
+#ifdef ALLOC_DEFER
+    header *fast[Fastbins]; // LIFO stacks of freed small blocks waiting to be coalesced, linked through linksof(hdr)->next.
+    word fastwords;         // Words in the blocks of the fast bins.
+    word fastblocks;        // Number of blocks in the fast bins.
+#endif
+#ifdef ALLOC_STATS
+    arenastats stats;   // Counters for alloc_stats().
+#endif
+#ifdef ALLOC_THREADS
+    pthread_mutex_t lock; // Protects everything above and all blocks of the arena.
+    header *remote;       // Lock-free stack of blocks freed by threads of other arenas, linked through linksof(hdr)->next.
+#endif
+};
+
+extern arena arenas[Arenas];
+
+// Per-thread cache geometry.
+// Blocks are cached per exact size; bin i holds blocks of Minwords + i * Alignwords words.
+#define Tcachebins 16 // Number of cached block sizes, starting at Minwords.
+#define Tcachemax 8   // Blocks kept per size before half of them are flushed back to the heap.
+#define Tcachefill 4  // Blocks taken from the heap per refill, under a single lock.
+
+// Cache bin for blocks of `w` words; at least Tcachebins for sizes that are not cached.
+#define tcacheBin(w) (((w) - Minwords) / Alignwords)
+
 // Helper macro to set the global 'errno' variable and return NULL
 // This is a common pattern for functions that indicate failure by returning NULL and setting errno.
 // The do-while(0) loop makes the macro behave like a single statement, preventing issues in if/else blocks without braces.
@@ -52,22 +343,349 @@ typedef struct packed s_header header; // Alias the struct type to 'header' for
         return NULL; \
     } while (0)
 
-// Helper macro to start searching for a free block from the beginning of the memspace.
-// Simplifies the initial call to findBlock_ by providing the starting address and offset.
-// FIX: Corrected the parameter order in the macro expansion.
-#define findBlock(words_to_alloc, start_offset) findBlock_((header *)(memspace), (words_to_alloc), (start_offset))
+// Tracing levels for the allocator's diagnostic output.
+// ALLOC_TRACE selects the most detailed level that is printed; anything above it compiles to nothing,
+// so a release build (-DALLOC_TRACE=0, or `make TRACE=0`) does no I/O at all on the alloc/free path.
+#define TraceErr 1 // Invalid frees and heap corruption.
+#define TraceOps 2 // One line per alloc()/freealloc() call, plus allocation failures.
+#define TraceAll 3 // Every block visited, split and merged (the original verbose output).
+
+#ifndef ALLOC_TRACE
+#define ALLOC_TRACE TraceAll
+#endif
+
+// Prints a trace line if `level` is enabled by ALLOC_TRACE.
+// The condition is a compile-time constant, so disabled calls are removed entirely while their arguments are still type-checked.
+#define trace(level, ...)                \
+    do                                   \
+    {                                    \
+        if ((level) <= ALLOC_TRACE)      \
+            printf(__VA_ARGS__);         \
+    } while (0)
+
+// Reports heap corruption caught by the hardened mode's checks and stops the process.
+// Carrying on would only hand the damaged memory to the next allocation, so this is not subject to ALLOC_TRACE.
+#define fatal(...)                    \
+    do                                \
+    {                                 \
+        fprintf(stderr, __VA_ARGS__); \
+        abort();                      \
+    } while (0)
+
+// Hardened mode keeps each thread's most recently freed blocks in a quarantine before they really go back to the heap,
+// with the start of their data overwritten by Poisonbyte; a write to a quarantined block shows up when it leaves (see quarantine in main.c).
+// -DQuarantineslots=0 turns the quarantine off and keeps only the header checks, which cost next to nothing.
+#ifndef Quarantineslots
+#define Quarantineslots 64 // Blocks held per thread.
+#endif
+#define Poisonbytes 16     // Bytes poisoned at the start of each quarantined block (fewer if it is smaller), a multiple of the word size.
+#define Poisonbyte 0xdb
+
+// Helper macro to search chunk `c` for a free block between `start_offset` and `end_offset` words into it.
+// Simplifies the call to findBlock_ by deriving the starting header from the offset.
+#define findBlock(c, words_to_alloc, start_offset, end_offset) findBlock_(blockAt((c), (start_offset)), (words_to_alloc), (start_offset), (end_offset))
+
+// Fixed-size object pool (see pool.c).
+// Slots are carved from slabs taken from the heap with alloc() and carry no per-object header.
+struct s_pool
+{
+    word size;    // Slot size in bytes (the object size rounded up to a multiple of ALLOC_ALIGN).
+    void *slabs;  // Most recent slab; each slab starts with a link to the one before it.
+    void *free;   // Intrusive LIFO list of freed slots, linked through their first word.
+    char *bump;   // Next never-used slot in the current slab.
+    char *end;    // End of the current slab.
+#ifdef ALLOC_THREADS
+    pthread_mutex_t lock; // Protects everything above.
+#endif
+};
+
+typedef struct s_pool pool;
+
+#ifdef ALLOC_THREADS
+#define lockpool(p) pthread_mutex_lock(&(p)->lock)
+#define unlockpool(p) pthread_mutex_unlock(&(p)->lock)
+#else
+#define lockpool(p) ((void)(p))
+#define unlockpool(p) ((void)(p))
+#endif
+
+// Slab geometry: small objects share 4 KB slabs; larger objects get slabs with room for at least Slabminobj of them.
+#define Slabbytes 4096
+#define Slabminobj 8
+#define Slabmaxobj (64 * 1024) // Larger objects are better served by alloc() directly.
 
-// External 1 MB static memory block defined in heap.asm
+// Bump-pointer region for memory that is freed all at once (see region.c).
+// "Region" rather than "arena", which already names the allocator's locked sub-heaps.
+struct s_region
+{
+    void *blocks; // Most recent heap block; each block starts with a link to the one before it and its size.
+    char *bump;   // Next free byte of the current block.
+    char *end;    // End of the current block.
+    word bytes;   // Size of a regular block; larger requests get a block of their own.
+#ifdef ALLOC_THREADS
+    pthread_mutex_t lock; // Protects everything above.
+#endif
+};
+
+typedef struct s_region region;
+
+#ifdef ALLOC_THREADS
+#define lockregion(r) pthread_mutex_lock(&(r)->lock)
+#define unlockregion(r) pthread_mutex_unlock(&(r)->lock)
+#else
+#define lockregion(r) ((void)(r))
+#define unlockregion(r) ((void)(r))
+#endif
+
+#define Regionbytes (64 * 1024) // Default block size of a region.
+#define Regionalign ALLOC_ALIGN // Alignment of every region_alloc result.
+
+// Snapshot of the allocator's counters returned by alloc_stats(); byte counts include block headers.
+// Thread caches and direct mappings are counted per thread, so the figures of a busy heap are not from one instant.
+struct s_allocstats
+{
+    size_t allocbytes;    // Bytes in allocated blocks, directly mapped blocks included (their whole mapping).
+    size_t allocblocks;   // Number of allocated blocks.
+    size_t freebytes;     // Bytes in free blocks of the arenas.
+    size_t freeblocks;    // Number of free blocks.
+    size_t cachedbytes;   // Bytes in freed blocks held by thread caches, counted neither as allocated nor as free.
+    size_t cachedblocks;  // Number of blocks held by thread caches.
+    size_t deferredbytes; // Bytes in freed blocks waiting in the arenas' fast bins (-DALLOC_DEFER), counted neither as allocated nor as free.
+    size_t deferredblocks; // Number of blocks waiting in fast bins.
+    size_t mappedbytes;   // Bytes in directly mapped blocks (part of allocbytes).
+    size_t mappedblocks;  // Number of directly mapped blocks (part of allocblocks).
+    size_t largestfree;   // Bytes in the largest free block.
+    size_t releasedbytes; // Bytes of free blocks whose pages were released to the OS by alloc_trim (part of freebytes).
+    double fragmentation; // External fragmentation: 1 - largestfree / freebytes, or 0 without free memory.
+    size_t splits;        // Free blocks split into an allocated block and a free remainder.
+    size_t coalesces;     // Free blocks merged with a free neighbour.
+    size_t searches[Probebuckets]; // Block searches by the number of blocks inspected (see Probebuckets).
+};
+
+typedef struct s_allocstats allocstats;
+
+// A heap snapshot written by alloc_snapshot() (see snapshot.c) starts with this header and continues with unsigned LEB128 varints:
+// for every chunk, its arena number plus one, its address and its size in words, followed by its runs and a 0.
+// A run is consecutive blocks in the same state: the varint (words << 1 | allocated) and then the number of blocks.
+// Free blocks are always coalesced, so every free run is a single block. A 0 in place of an arena number ends the snapshot.
+struct s_snapshot
+{
+    char magic[8];   // Snapshotmagic, without the terminating NUL.
+    int32 version;   // Snapshotversion of the writer.
+    int32 wordbytes; // Bytes per word of the heap, the unit of every size in the snapshot.
+};
+
+#define Snapshotmagic "ALLOCSNP"
+#define Snapshotversion 1
+
+// One allocator call logged by the recorder (see record.c), as stored in a trace file.
+// The layout does not depend on the word size, so a trace recorded by a 32-bit build replays in a 64-bit one and vice versa.
+struct s_event
+{
+    int64 ns;     // Time since recording started, in nanoseconds.
+    int64 id;     // Address the call returned (0 if it failed), or the address freed by a RecFree.
+    int64 arg;    // RecRealloc: the address that was resized. RecAligned: the alignment. RecCalloc: the object count.
+    int64 bytes;  // Bytes requested (RecCalloc: the object size); 0 for RecFree.
+    int32 op;     // One of the Rec* operations below.
+    int32 thread; // Recording thread, numbered from 1 in the order threads first called the allocator.
+};
+
+typedef struct s_event event;
+
+#define RecAlloc 1   // alloc(), and each block of alloc_batch()
+#define RecFree 2    // freealloc() or free_sized(), and each block of free_batch()
+#define RecRealloc 3 // realloc_block() with a block and a non-zero size
+#define RecAligned 4 // alloc_aligned()
+#define RecCalloc 5  // calloc_block()
+
+// A trace file is this header followed by its events, oldest first.
+struct s_tracefile
+{
+    char magic[8];    // Recordmagic, without the terminating NUL.
+    int32 version;    // Recordversion of the recorder that wrote it.
+    int32 eventbytes; // sizeof(event), as a check.
+};
+
+#define Recordmagic "ALLOCREC"
+#define Recordversion 1
+
+// Events the recorder buffers before they are written out (a power of two), and how long its flusher thread sleeps between writes.
+#define Recordslots (64 * 1024)
+#define Recordnap 1000000 // Nanoseconds.
+
+// Recording hooks on the public entry points (-DALLOC_RECORD, or `make RECORD=1`); they compile to nothing otherwise.
+// recordOpen reserves the event's place in the trace and recordClose fills it in, so a call can be ordered by when it started
+// (realloc_block frees the old block before it returns). recordCall does both at once.
+#ifdef ALLOC_RECORD
+extern bool recording;
+#define Recordoff (~(int64)0)
+#define recordOpen() (__atomic_load_n(&recording, __ATOMIC_RELAXED) ? recordBegin() : Recordoff)
+#define recordClose(pos, op, bytes, id, arg)                                                  \
+    do                                                                                        \
+    {                                                                                         \
+        if ((pos) != Recordoff)                                                               \
+            recordEnd((pos), (op), (int64)(bytes), (int64)(size_t)(id), (int64)(size_t)(arg)); \
+    } while (0)
+#else
+#define recordOpen() ((int64)0)
+#define recordClose(pos, op, bytes, id, arg) ((void)(pos))
+#endif
+#define recordCall(op, bytes, id, arg)                        \
+    do                                                        \
+    {                                                         \
+        int64 pos_ = recordOpen();                            \
+        recordClose(pos_, (op), (bytes), (id), (arg));        \
+    } while (0)
+
+// Heap profiling (-DALLOC_PROFILE, or `make PROFILE=1`; see profile.c): about one allocation in every Profilerate bytes
+// allocated has its call stack sampled, and profile_dump_fd() writes the live sampled blocks per stack for pprof.
+#define Profilerate (512 * 1024) // Mean bytes allocated between two samples, unless profile_start() is given a rate.
+#define Profiledepth 32          // Frames kept of each sampled call stack.
+#define Profilestacks 4096       // Distinct call stacks that can be profiled (a power of two).
+#define Profileslots 65536       // Slots for the live sampled blocks, at most 3/4 of them used (a power of two).
+#define Profilefilter 262144     // Counters of the filter that lets frees of unsampled blocks skip the lock (a power of two).
+
+// Profiling hooks on the public entry points; they compile to nothing without ALLOC_PROFILE.
+// profileAlloc counts the bytes of every allocation down to the thread's next sample; profileFree only looks the block up
+// while any sampled block is live. A block must be forgotten before it is freed, as its address may be reused at once.
+#ifdef ALLOC_PROFILE
+extern bool profiling;
+extern word profiled;
+extern threadlocal size_t sampleleft;
+#define profileAlloc(ptr, bytes)                                           \
+    do                                                                     \
+    {                                                                      \
+        if (__atomic_load_n(&profiling, __ATOMIC_RELAXED) && (ptr))        \
+        {                                                                  \
+            if ((size_t)(bytes) >= sampleleft)                             \
+                profileSample((ptr), (bytes));                             \
+            else                                                           \
+                sampleleft -= (bytes);                                     \
+        }                                                                  \
+    } while (0)
+#define profileFree(ptr)                                                   \
+    do                                                                     \
+    {                                                                      \
+        if (__atomic_load_n(&profiled, __ATOMIC_RELAXED) && (ptr))         \
+            profileForget(ptr);                                            \
+    } while (0)
+#else
+#define profileAlloc(ptr, bytes) ((void)(ptr))
+#define profileFree(ptr) ((void)(ptr))
+#endif
+
+// External static memory block of Heapbytes bytes defined in heap.asm
 // This is the raw memory area that our allocator will manage.
 // Declared as 'extern char' to get a byte pointer to the start of the memory block.
 extern char memspace[];
 
 // Function declarations
+// Segregated free-list management (size-class bins threaded through free blocks, and a size tree for large ones).
+word binIndex(word w);                     // Maps a block size in words to its bin
+void binInsert(arena *a, header *hdr);     // Pushes a free block onto the head of its bin, or into the size tree
+void binRemove(arena *a, header *hdr);     // Unlinks a free block from its bin or the size tree
+header *binFind(arena *a, word total_size); // Finds a free block of at least `total_size` words (header included)
+header *binBest(arena *a, word total_size); // Finds the smallest free block of at least `total_size` words
+void tagBoundary(header *hdr);             // Writes the footer of a free block and the successor's prevfree bit
+
+// Arena selection.
+arena *arenaOf(header *hdr); // Arena owning the block with header `hdr`
+arena *threadArena(void);    // Arena the calling thread allocates from
+void *arenaAlloc(size_t bytes, word align, char **fresh); // Allocates from the thread's arena, falling back to the others
+
+// Large blocks mapped directly from the OS.
+void *bigAlloc(size_t bytes);         // Maps a block of its own for a large request
+bool bigFree(header *hdr);            // Unmaps a block if it came from bigAlloc
+char *bigMapping(header *hdr);        // Start of a block's mapping if it came from bigAlloc, otherwise NULL
+void *bigRealloc(char *map, size_t bytes); // Resizes a directly mapped block with mremap
+void setmmapthreshold(size_t bytes);  // Sets the request size from which blocks are mapped directly
+
+// Heap chunks (the memspace slices plus chunks mapped on demand).
+chunk *chunkOf(header *hdr);                      // Chunk containing header `hdr`, or NULL if it is not in the heap
+header *chunkGrow(arena *a, word words_to_alloc); // Maps a new chunk for arena `a` big enough for the request
+void chunkTrim(arena *a);                         // Returns fully free tail chunks of arena `a` to the OS
+
+// Releasing idle memory to the OS.
+size_t alloc_trim(void);              // Releases the pages of free blocks to the OS; returns the bytes released
+#ifdef ALLOC_THREADS
+bool alloc_trim_start(word period_ms); // Starts trimming idle arenas every `period_ms` milliseconds in a background thread
+void alloc_trim_stop(void);            // Stops the background trimmer
+#endif
+
 // The core memory allocation functions provided by this allocator.
-header *findBlock_(header *hdr, word words_to_alloc, word n); // Finds a free block of suitable size
-void freealloc(void *ptr);
-void *mkalloc(word words_to_alloc, header *hdr);              // Marks a block as allocated
-void *alloc(int32 bytes);                                     // Top-level allocation function (similar to malloc)
+header *findBlock_(header *hdr, word words_to_alloc, word n, word end); // Walks the heap for a free block of suitable size
+header *findFit(arena *a, word words_to_alloc);                         // Finds a free block in an arena using the current search policy
+bool setpolicy(int32 p);                                                // Selects the search policy (FitBins, FitFirst, FitNext, FitBest)
+void freealloc(void *ptr);                                    // Top-level free function (similar to free)
+void freealloc_(void *ptr);                                   // Frees a block straight into its arena (arena lock held)
+void free_sized(void *ptr, size_t bytes);                     // Frees a block of known requested size (similar to C23 free_sized)
+size_t alloc_usable_size(void *ptr);                          // Bytes a block can actually hold (similar to malloc_usable_size)
+void *mkalloc(arena *a, word words_to_alloc, header *hdr);    // Marks a block as allocated
+void *alloc(size_t bytes);                                    // Top-level allocation function (similar to malloc)
+void *alloc_(arena *a, size_t bytes);                         // Allocates from one arena (arena lock held)
+void *alloc_aligned(size_t bytes, word align);                // Allocation whose address is a multiple of `align` (similar to aligned_alloc)
+void *alloc_on_node(size_t bytes, int32 node);                // Allocation from memory on NUMA node `node` (similar to numa_alloc_onnode)
+void *allocAligned_(arena *a, size_t bytes, word align);      // Aligned allocation from one arena (arena lock held)
+word wordsFor(size_t bytes);                                  // Data words reserved for a request of `bytes` bytes
+void *realloc_block(void *ptr, size_t new_bytes);             // Resizes a block, in place when possible (similar to realloc)
+void *calloc_block(size_t count, size_t size);                // Zeroed allocation that skips never-used memory (similar to calloc)
+size_t alloc_batch(size_t size, size_t n, void **out);        // Allocates `n` equal blocks from one contiguous free block
+size_t allocBatch_(arena *a, size_t bytes, size_t n, void **out); // Batch allocation from one arena (arena lock held)
+void free_batch(void **ptrs, size_t n);                       // Frees a batch of blocks, joining neighbours before freeing
+bool resize_(arena *a, header *hdr, word words);              // Resizes a block in place (arena lock held)
+
+#ifdef ALLOC_THREADS
+void *tcacheAlloc(word words); // Serves a small allocation from the calling thread's cache
+bool tcacheFree(header *hdr);  // Keeps a freed small block in the calling thread's cache
+bool remoteFree(header *hdr);  // Queues a block owned by another thread's arena for that arena, without its lock
+void remoteDrain_(arena *a);   // Frees the blocks queued on an arena's remote stack (arena lock held)
+void forkPrepare(void);        // Takes every allocator lock before a fork (pthread_atfork prepare handler)
+void forkParent(void);         // Releases them in the parent after a fork
+void forkChild(void);          // Resets them in the child after a fork
+#else
+#define remoteDrain_(a) ((void)(a))
+#endif
+
+#ifdef ALLOC_DEFER
+bool fastConsolidate_(arena *a); // Coalesces the blocks parked in an arena's fast bins (arena lock held)
+#endif
+
+// Fixed-size object pools.
+pool *pool_create(int32 obj_size); // Creates a pool of `obj_size`-byte objects
+void *pool_alloc(pool *p);         // Allocates one object from a pool
+void pool_free(pool *p, void *ptr); // Returns an object to the pool it came from
+void pool_destroy(pool *p);        // Frees a pool and all of its slabs
+
+// Bump-pointer regions.
+region *region_new(size_t block_bytes);        // Creates a region that takes `block_bytes`-byte blocks from the heap (0 for the default)
+void *region_alloc(region *r, size_t bytes);  // Allocates `bytes` bytes from a region with a pointer bump
+void region_reset(region *r);                 // Frees everything allocated from a region at once, keeping one block for reuse
+void region_destroy(region *r);               // Frees a region and all of its blocks
+
+#ifdef ALLOC_RECORD
+// Allocation recording.
+bool record_start(const char *path); // Starts logging every allocator call to the trace file `path`
+void record_stop(void);              // Stops logging and writes out the events still buffered
+int64 recordBegin(void);             // Reserves the next event of the trace
+void recordEnd(int64 pos, int32 op, int64 bytes, int64 id, int64 arg); // Fills in a reserved event
+#endif
+
+#ifdef ALLOC_PROFILE
+// Heap profiling.
+bool profile_start(word rate);         // Starts sampling allocations about every `rate` bytes (0 for Profilerate)
+void profile_stop(void);               // Stops sampling; blocks sampled so far stay in the profile until freed
+bool profile_dump_fd(int fd);          // Writes the live sampled blocks per call stack to `fd` in pprof's heap format
+void profileSample(void *ptr, size_t bytes); // Samples a block once the thread's countdown runs out
+void profileForget(void *ptr);         // Drops the sample of a block about to be freed, if it has one
+#endif
+
+#ifdef ALLOC_STATS
+void alloc_stats(allocstats *out); // Reads the allocator's counters without walking the heap
+#endif
+
+// Heap snapshots.
+size_t alloc_snapshot(void *buf, size_t bytes); // Writes the block map to `buf`; returns the size the whole snapshot needs
+bool alloc_snapshot_fd(int fd);                 // Writes the block map to file descriptor `fd`
 
 // Helper function to print the current state of the memory layout (blocks and their status).
 void print_memory_layout();
@@ -0,0 +1,134 @@
+/*
+ * Fixed-size object pools (slab allocator) layered on alloc().
+ * A pool hands out equal-sized slots carved from slabs, which are ordinary heap blocks.
+ * Slots carry no header: free slots are threaded on an intrusive free list through their first word,
+ * so pool_alloc and pool_free are a pointer pop and push in the common case.
+ * Having no header, a slot can only be freed with pool_free; freealloc(), free_sized() and alloc_usable_size() take heap blocks only.
+ */
+
+#include "main.h"
+
+// Bytes at the start of a slab taken by its link to the previous slab, rounded up so the first slot is ALLOC_ALIGN-aligned too.
+#define Slabhead ((word)((sizeof(void *) + ALLOC_ALIGN - 1) & ~(size_t)(ALLOC_ALIGN - 1)))
+
+/*
+ * Creates a pool of `obj_size`-byte objects.
+ * The slot size is rounded up to a multiple of ALLOC_ALIGN, so every slot can hold the free-list link and is aligned like a block from alloc().
+ * Returns the new pool, or NULL with errno set (ErrInval for a zero or oversized object, ErrNoMem if the heap is full).
+ */
+pool *pool_create(int32 obj_size)
+{
+    if (obj_size == 0 || obj_size > Slabmaxobj)
+    {
+        trace(TraceErr, "pool: Error: Invalid object size %u.\n", obj_size);
+        reterr(ErrInval);
+    }
+
+    pool *p = alloc(sizeof(pool));
+    if (!p)
+        return NULL;
+
+    p->size = (obj_size + ALLOC_ALIGN - 1) & ~(word)(ALLOC_ALIGN - 1);
+    p->slabs = NULL;
+    p->free = NULL;
+    p->bump = NULL;
+    p->end = NULL;
+#ifdef ALLOC_THREADS
+    pthread_mutex_init(&p->lock, NULL);
+#endif
+
+    trace(TraceOps, "pool: Created pool %p for %u-byte objects (%lu-byte slots).\n", (void *)p, obj_size, p->size);
+    return p;
+}
+
+/*
+ * Takes a new slab from the heap and makes it the pool's bump region.
+ * The slab starts with a link to the previous slab so pool_destroy can give them all back.
+ * Returns false if the heap is out of memory.
+ */
+static bool poolGrow(pool *p)
+{
+    // Small objects share a fixed-size slab; larger ones get a slab of Slabminobj slots so the per-slab link stays negligible.
+    word bytes = Slabhead + Slabminobj * p->size;
+    if (bytes < Slabbytes)
+        bytes = Slabbytes;
+
+    void **slab = alloc(bytes);
+    if (!slab)
+        return false;
+
+    *slab = p->slabs;
+    p->slabs = slab;
+
+    // Slots are carved lazily from the bump region, so a fresh slab is not touched until it is used.
+    p->bump = (char *)slab + Slabhead;
+    p->end = (char *)slab + bytes;
+
+    trace(TraceAll, "pool: Pool %p took a %lu-byte slab at %p.\n", (void *)p, bytes, (void *)slab);
+    return true;
+}
+
+/*
+ * Allocates one object from pool `p`.
+ * Reuses the most recently freed slot if there is one, otherwise carves the next slot of the current slab.
+ * Returns NULL with errno set to ErrNoMem if a new slab was needed and the heap is full.
+ */
+void *pool_alloc(pool *p)
+{
+    void *slot = NULL;
+
+    lockpool(p);
+    if (p->free)
+    {
+        slot = p->free;
+        p->free = *(void **)slot;
+    }
+    else if (p->end - p->bump >= (ptrdiff_t)p->size || poolGrow(p))
+    {
+        slot = p->bump;
+        p->bump += p->size;
+    }
+    unlockpool(p);
+
+    return slot;
+}
+
+/*
+ * Returns object `ptr` to pool `p`, which must be the pool it was allocated from.
+ * The slot goes on the pool's free list for the next pool_alloc; slabs are only returned to the heap by pool_destroy.
+ */
+void pool_free(pool *p, void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    lockpool(p);
+    *(void **)ptr = p->free;
+    p->free = ptr;
+    unlockpool(p);
+}
+
+/*
+ * Frees pool `p` and every slab it took from the heap, with one freealloc per slab.
+ * All objects allocated from the pool become invalid.
+ */
+void pool_destroy(pool *p)
+{
+    if (p == NULL)
+        return;
+
+    trace(TraceOps, "pool: Destroying pool %p.\n", (void *)p);
+
+    void **slab = p->slabs;
+    while (slab)
+    {
+        void **prev = *slab;
+        freealloc(slab);
+        slab = prev;
+    }
+
+#ifdef ALLOC_THREADS
+    pthread_mutex_destroy(&p->lock);
+#endif
+    freealloc(p);
+}
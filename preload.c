@@ -0,0 +1,109 @@
+/*
+ * Drop-in replacement for the C library's allocator (`make preload`, which builds libmemalloc.so).
+ * Programs run on it unchanged with LD_PRELOAD=./libmemalloc.so; every malloc-family call then goes to alloc() and freealloc().
+ * The library is a thread-safe build without tracing, since stdio allocates, and only the functions below are exported,
+ * so the allocator's own names cannot clash with the program's. The heap needs no set-up call: each arena initialises
+ * itself on its first allocation, so calls made while the process is still starting up, before any constructor has run, work.
+ * The allocator reports errors with its own codes (see main.h); they are turned into the errno values C callers expect.
+ */
+
+#include "main.h"
+
+#ifndef ALLOC_THREADS
+#error "libmemalloc.so needs a thread-safe build (-DALLOC_THREADS)"
+#endif
+
+#define exported __attribute__((visibility("default")))
+
+// Sets errno from the allocator's error code after a failed call.
+static void libcErr(void)
+{
+    errno = errno == ErrInval ? EINVAL : ENOMEM;
+}
+
+// Registers the fork handlers as soon as the library is loaded, before the program's main() starts any thread.
+__attribute__((constructor)) static void preloadInit(void)
+{
+    pthread_atfork(forkPrepare, forkParent, forkChild);
+}
+
+exported void *malloc(size_t bytes)
+{
+    void *ptr = alloc(bytes);
+    if (!ptr)
+        libcErr();
+    return ptr;
+}
+
+exported void free(void *ptr)
+{
+    freealloc(ptr);
+}
+
+exported void *calloc(size_t count, size_t size)
+{
+    void *ptr = calloc_block(count, size);
+    if (!ptr)
+        libcErr();
+    return ptr;
+}
+
+// Like glibc, a size of 0 frees the block and returns NULL.
+exported void *realloc(void *ptr, size_t bytes)
+{
+    void *resized = realloc_block(ptr, bytes);
+    if (!resized && (bytes || !ptr))
+        libcErr();
+    return resized;
+}
+
+// Returns EINVAL unless `align` is a power of two and a multiple of sizeof(void *), as POSIX requires; ENOMEM if out of memory.
+exported int posix_memalign(void **out, size_t align, size_t bytes)
+{
+    if (align < sizeof(void *) || (align & (align - 1)))
+        return EINVAL;
+
+    void *ptr = alloc_aligned(bytes, align);
+    if (!ptr)
+        return ENOMEM;
+
+    *out = ptr;
+    return 0;
+}
+
+exported void *aligned_alloc(size_t align, size_t bytes)
+{
+    void *ptr = alloc_aligned(bytes, align);
+    if (!ptr)
+        libcErr();
+    return ptr;
+}
+
+// Obsolete, but still called by some libraries, whose blocks must not end up in glibc's heap.
+exported void *memalign(size_t align, size_t bytes)
+{
+    return aligned_alloc(align, bytes);
+}
+
+exported void *valloc(size_t bytes)
+{
+    return aligned_alloc((size_t)sysconf(_SC_PAGESIZE), bytes);
+}
+
+// valloc with the size rounded up to whole pages; like glibc, a size of 0 takes one page.
+exported void *pvalloc(size_t bytes)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if (bytes > (size_t)-1 - (page - 1))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return valloc(bytes ? (bytes + page - 1) & ~(page - 1) : page);
+}
+
+exported size_t malloc_usable_size(void *ptr)
+{
+    return alloc_usable_size(ptr);
+}
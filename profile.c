@@ -0,0 +1,392 @@
+/*
+ * Sampling heap profiler (-DALLOC_PROFILE, or `make PROFILE=1`).
+ * Tracking every allocation is too slow to leave on, so each thread counts the bytes it allocates down to a random threshold,
+ * drawn from an exponential distribution with a mean of the sampling rate, and only the allocation that crosses it has
+ * its call stack captured. A block of s bytes is then sampled with probability 1 - exp(-s / rate) whatever came before it,
+ * which is what pprof assumes when it scales the samples of a heap_v2 profile back up to the whole heap.
+ * Sampled blocks are remembered by address until they are freed, and profile_dump_fd() writes the live ones per call stack.
+ * All the tables are mapped from the OS rather than taken from the heap, so profiling does not change the heap it profiles.
+ */
+
+#include "main.h"
+
+#ifdef ALLOC_PROFILE
+
+#include <execinfo.h>
+#include <fcntl.h>
+#include <time.h>
+
+bool profiling;                  // Set while allocations are being sampled.
+word profiled;                   // Sampled blocks that are still live; frees skip the profiler while it is 0.
+threadlocal size_t sampleleft;   // Bytes this thread may still allocate before its next sample.
+
+static threadlocal bool armed;   // Whether sampleleft has been drawn since the thread started or profiling was restarted.
+static threadlocal bool sampling; // Set while this thread captures a stack, whose unwinder may allocate.
+static threadlocal int64 seed;   // State of this thread's random number generator (0 until first used).
+static int32 generation;         // Bumped by every profile_start, so threads draw their countdowns afresh at the new rate.
+static threadlocal int32 mygeneration;
+
+static word rate;                // Mean bytes between two samples.
+static word dropped;             // Samples lost because a table was full.
+
+// A distinct call stack, with the sampled blocks allocated from it: those still live and all of them.
+struct s_stack
+{
+    int64 hash;   // Hash of the frames (0 for an unused entry).
+    word depth;   // Frames in `frames`.
+    void *frames[Profiledepth];
+    word liveblocks;
+    size_t livebytes;
+    word allblocks;
+    size_t allbytes;
+};
+
+typedef struct s_stack stack;
+
+// A live sampled block: its address (NULL for an empty slot), the bytes requested and the stack it was allocated from.
+struct s_sample
+{
+    void *ptr;
+    size_t bytes;
+    word stack;
+};
+
+typedef struct s_sample sample;
+
+static stack *stacks;   // Open-addressed by stack hash, Profilestacks entries.
+static sample *samples; // Open-addressed by block address, Profileslots entries.
+static int32 *filter;   // Live samples per hash of their address, read without the lock; Profilefilter counters.
+static stack *copy;     // Where profile_dump_fd copies the stacks to write them out without holding the lock.
+
+#ifdef ALLOC_THREADS
+static pthread_mutex_t profilelock = PTHREAD_MUTEX_INITIALIZER;
+#define lockprofile() pthread_mutex_lock(&profilelock)
+#define unlockprofile() pthread_mutex_unlock(&profilelock)
+#else
+#define lockprofile() ((void)0)
+#define unlockprofile() ((void)0)
+#endif
+
+#define slotOf(ptr) ((word)(((int64)(size_t)(ptr) >> 4) * 0x9e3779b97f4a7c15ull >> 40) & (Profileslots - 1))
+#define filterOf(ptr) ((word)(((int64)(size_t)(ptr) >> 4) * 0xc2b2ae3d27d4eb4full >> 40) & (Profilefilter - 1))
+
+// Returns the next number of this thread's xorshift64* generator, seeded from the thread's address and the clock.
+static int64 random64(void)
+{
+    if (!seed)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        seed = ((int64)(size_t)&seed * 0x9e3779b97f4a7c15ull) ^ ((int64)ts.tv_sec << 32) ^ ts.tv_nsec;
+        seed |= 1;
+    }
+
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return seed * 0x2545f4914f6cdd1dull;
+}
+
+/*
+ * Returns -ln(u) for a uniform u in (0, 1] made from the top 53 bits of `r`, without libm.
+ * u is scaled to m * 2^-e with m in [1, 2), and ln(m) = 2 atanh((m - 1) / (m + 1)), whose series converges fast there.
+ */
+static double negLog(int64 r)
+{
+    double u = (double)((r >> 11) + 1) / 9007199254740992.0;
+    int32 e = 0;
+    while (u < 1)
+    {
+        u *= 2;
+        e++;
+    }
+
+    double s = (u - 1) / (u + 1), s2 = s * s;
+    double lnm = 2 * s * (1 + s2 * (1.0 / 3 + s2 * (1.0 / 5 + s2 * (1.0 / 7 + s2 / 9))));
+    return e * 0.6931471805599453 - lnm;
+}
+
+// Draws the bytes until the next sample: exponentially distributed with a mean of `rate`, and at least 1.
+static size_t nextSample(void)
+{
+    double bytes = negLog(random64()) * __atomic_load_n(&rate, __ATOMIC_RELAXED);
+    return bytes < 1 ? 1 : bytes > (double)((size_t)-1 / 2) ? (size_t)-1 / 2 : (size_t)bytes;
+}
+
+// Returns the entry of the call stack `frames` in the stack table, adding it if it is new, or NULL if the table is full.
+static stack *stackOf(void **frames, word depth)
+{
+    int64 hash = 0xcbf29ce484222325ull;
+    for (word i = 0; i < depth; i++)
+        hash = (hash ^ (int64)(size_t)frames[i]) * 0x100000001b3ull;
+    hash |= 1;
+
+    for (word n = 0, i = (word)hash & (Profilestacks - 1); n < Profilestacks; n++, i = (i + 1) & (Profilestacks - 1))
+    {
+        stack *s = &stacks[i];
+        if (!s->hash)
+        {
+            s->hash = hash;
+            s->depth = depth;
+            memcpy(s->frames, frames, depth * sizeof(void *));
+            return s;
+        }
+        if (s->hash == hash && s->depth == depth && !memcmp(s->frames, frames, depth * sizeof(void *)))
+            return s;
+    }
+
+    return NULL;
+}
+
+/*
+ * Samples the block `ptr` of `bytes` bytes requested, which crossed the calling thread's countdown (see profileAlloc).
+ * The stack is captured before the lock is taken, as the unwinder may allocate; those allocations are not sampled.
+ */
+void profileSample(void *ptr, size_t bytes)
+{
+    if (sampling)
+        return;
+
+    // A thread's first countdown is drawn on its first allocation, which is only sampled if it crosses that countdown too.
+    int32 gen = __atomic_load_n(&generation, __ATOMIC_RELAXED);
+    if (!armed || mygeneration != gen)
+    {
+        armed = true;
+        mygeneration = gen;
+        sampleleft = nextSample();
+        if (bytes < sampleleft)
+        {
+            sampleleft -= bytes;
+            return;
+        }
+    }
+    sampleleft = nextSample();
+
+    // The first frame is this function and the second the entry point that called it.
+    void *frames[Profiledepth + 2];
+    sampling = true;
+    int depth = backtrace(frames, Profiledepth + 2);
+    sampling = false;
+    if (depth <= 2)
+        return;
+
+    lockprofile();
+    stack *s = stackOf(frames + 2, depth - 2);
+    word live = __atomic_load_n(&profiled, __ATOMIC_RELAXED);
+    if (!s || live >= Profileslots / 4 * 3)
+    {
+        dropped++;
+        unlockprofile();
+        return;
+    }
+
+    word i = slotOf(ptr);
+    while (samples[i].ptr)
+        i = (i + 1) & (Profileslots - 1);
+    samples[i] = (sample){ptr, bytes, (word)(s - stacks)};
+
+    s->liveblocks++;
+    s->livebytes += bytes;
+    s->allblocks++;
+    s->allbytes += bytes;
+    __atomic_add_fetch(&filter[filterOf(ptr)], 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&profiled, live + 1, __ATOMIC_RELAXED);
+    unlockprofile();
+}
+
+/*
+ * Drops the sample of the block `ptr` if it has one, before the block is freed.
+ * The filter counter of the address is read first, so the frees of unsampled blocks, nearly all of them, take no lock.
+ * A sample's counter is raised before the block is handed back to the program, so it cannot be missed by its own free.
+ */
+void profileForget(void *ptr)
+{
+    if (!__atomic_load_n(&filter[filterOf(ptr)], __ATOMIC_RELAXED))
+        return;
+
+    lockprofile();
+    word i = slotOf(ptr);
+    while (samples[i].ptr && samples[i].ptr != ptr)
+        i = (i + 1) & (Profileslots - 1);
+
+    if (samples[i].ptr)
+    {
+        stack *s = &stacks[samples[i].stack];
+        s->liveblocks--;
+        s->livebytes -= samples[i].bytes;
+        __atomic_sub_fetch(&filter[filterOf(ptr)], 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&profiled, 1, __ATOMIC_RELAXED);
+
+        // Backward-shift deletion: move later samples of the same probe run up, so no lookup stops early at the hole.
+        for (word j = (i + 1) & (Profileslots - 1); samples[j].ptr; j = (j + 1) & (Profileslots - 1))
+        {
+            word home = slotOf(samples[j].ptr);
+            if (((j - home) & (Profileslots - 1)) >= ((j - i) & (Profileslots - 1)))
+            {
+                samples[i] = samples[j];
+                i = j;
+            }
+        }
+        samples[i].ptr = NULL;
+    }
+    unlockprofile();
+}
+
+/*
+ * Starts sampling about one allocation in every `rate` bytes allocated, 0 meaning Profilerate, and forgets earlier samples.
+ * The tables are mapped from the OS on first use. The unwinder is run once here, as its first run may load libraries.
+ * Returns false with errno set to ErrNoMem if the tables could not be mapped.
+ */
+bool profile_start(word bytes)
+{
+    if (!stacks)
+    {
+        size_t size = Profilestacks * sizeof(stack) * 2 + Profileslots * sizeof(sample) + Profilefilter * sizeof(int32);
+        char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED)
+        {
+            errno = ErrNoMem;
+            return false;
+        }
+        stacks = (stack *)map;
+        copy = stacks + Profilestacks;
+        samples = (sample *)(copy + Profilestacks);
+        filter = (int32 *)(samples + Profileslots);
+
+        void *frames[2];
+        backtrace(frames, 2);
+    }
+
+    __atomic_store_n(&profiling, false, __ATOMIC_RELAXED);
+    lockprofile();
+    memset(stacks, 0, Profilestacks * sizeof(stack));
+    memset(samples, 0, Profileslots * sizeof(sample));
+    memset(filter, 0, Profilefilter * sizeof(int32));
+    __atomic_store_n(&profiled, 0, __ATOMIC_RELAXED);
+    dropped = 0;
+    __atomic_store_n(&rate, bytes ? bytes : Profilerate, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+    unlockprofile();
+
+    trace(TraceOps, "profile: Sampling every %lu bytes on average.\n", rate);
+    __atomic_store_n(&profiling, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * Stops sampling new allocations. The blocks sampled so far stay in the profile, and leave it when they are freed.
+ */
+void profile_stop(void)
+{
+    __atomic_store_n(&profiling, false, __ATOMIC_RELAXED);
+    trace(TraceOps, "profile: Stopped sampling with %lu sampled blocks live.\n", profiled);
+}
+
+// Output of profile_dump_fd, buffered so it takes a few large writes.
+struct s_output
+{
+    int fd;
+    bool failed;
+    size_t used;
+    char buf[4096];
+};
+
+static void flushOutput(struct s_output *out)
+{
+    for (size_t done = 0; !out->failed && done < out->used;)
+    {
+        ssize_t n = write(out->fd, out->buf + done, out->used - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            out->failed = true;
+        else
+            done += n;
+    }
+    out->used = 0;
+}
+
+static void putText(struct s_output *out, const char *text, size_t bytes)
+{
+    while (bytes)
+    {
+        if (out->used == sizeof(out->buf))
+            flushOutput(out);
+        size_t n = bytes < sizeof(out->buf) - out->used ? bytes : sizeof(out->buf) - out->used;
+        memcpy(out->buf + out->used, text, n);
+        out->used += n;
+        text += n;
+        bytes -= n;
+    }
+}
+
+/*
+ * Writes the live sampled blocks per call stack to file descriptor `fd`, in the text heap profile format of gperftools,
+ * which `pprof <program> <file>` reads: a header line with the totals and the sampling rate, one line per call stack with
+ * its live and total sampled blocks and bytes and its return addresses, then the process's memory map to symbolise them.
+ * The counts are of sampled blocks only; pprof scales them up to estimates for the whole heap.
+ * The stacks are copied under the lock and written out after it is released, so a slow file does not hold up allocations.
+ * Returns false with errno set (ErrInval if profiling was never started, otherwise as set by write).
+ */
+bool profile_dump_fd(int fd)
+{
+    if (!stacks)
+    {
+        errno = ErrInval;
+        return false;
+    }
+
+    lockprofile();
+    memcpy(copy, stacks, Profilestacks * sizeof(stack));
+    word lost = dropped;
+    unlockprofile();
+
+    if (lost)
+        trace(TraceErr, "profile: Warning: %lu samples were dropped because the profiler's tables were full.\n", lost);
+
+    int64 liveblocks = 0, livebytes = 0, allblocks = 0, allbytes = 0;
+    for (word i = 0; i < Profilestacks; i++)
+    {
+        liveblocks += copy[i].liveblocks;
+        livebytes += copy[i].livebytes;
+        allblocks += copy[i].allblocks;
+        allbytes += copy[i].allbytes;
+    }
+
+    struct s_output out = {.fd = fd};
+    char line[160];
+    int n = snprintf(line, sizeof(line), "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%lu\n", liveblocks, livebytes,
+                     allblocks, allbytes, __atomic_load_n(&rate, __ATOMIC_RELAXED));
+    putText(&out, line, n);
+
+    for (word i = 0; i < Profilestacks; i++)
+    {
+        stack *s = &copy[i];
+        if (!s->hash)
+            continue;
+
+        n = snprintf(line, sizeof(line), "%lu: %zu [%lu: %zu] @", s->liveblocks, s->livebytes, s->allblocks, s->allbytes);
+        putText(&out, line, n);
+        for (word k = 0; k < s->depth; k++)
+        {
+            n = snprintf(line, sizeof(line), " %p", s->frames[k]);
+            putText(&out, line, n);
+        }
+        putText(&out, "\n", 1);
+    }
+
+    putText(&out, "\nMAPPED_LIBRARIES:\n", 19);
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps >= 0)
+    {
+        char buf[4096];
+        for (ssize_t got; (got = read(maps, buf, sizeof(buf))) > 0;)
+            putText(&out, buf, got);
+        close(maps);
+    }
+
+    flushOutput(&out);
+    return !out.failed;
+}
+
+#endif
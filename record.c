@@ -0,0 +1,242 @@
+/*
+ * Allocation recorder (-DALLOC_RECORD, or `make RECORD=1`).
+ * While recording is on, every call to the public allocation and free functions is logged as a fixed-size binary event
+ * (see struct s_event), so a production workload can be captured and replayed offline against other configurations (see replay.c).
+ * Events go into a preallocated ring; in thread-safe builds a background thread writes them out, so the allocating threads never do I/O.
+ * Single-threaded builds have no flusher thread and write the ring out themselves whenever it fills up.
+ */
+
+#include "main.h"
+
+#ifdef ALLOC_RECORD
+
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+
+bool recording; // Set while events are being logged.
+
+// The ring: event `pos` lives in slot pos % Recordslots, and seqs[] of that slot becomes pos + 1 once the event is complete.
+// Positions are 64-bit, so they never wrap around.
+static event *events;
+static int64 *seqs;
+static int64 head; // Next position handed out by recordBegin.
+static int64 tail; // First position not yet written to the trace file.
+
+static int recordfd = -1;
+static int64 startns;                 // Clock reading when recording started.
+static int32 threads;                 // Threads numbered so far.
+static threadlocal int32 threadnum;   // This thread's number in the trace (0 until its first event).
+
+#ifdef ALLOC_THREADS
+static pthread_t flusher;
+static bool flushing; // The flusher thread keeps running while set.
+#endif
+
+static inline int64 recordClock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Writes `bytes` bytes to the trace file, retrying on short writes. Returns false on an I/O error.
+static bool recordWrite(const void *buf, size_t bytes)
+{
+    const char *p = buf;
+    while (bytes)
+    {
+        ssize_t n = write(recordfd, p, bytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+/*
+ * Writes out the completed events at the tail of the ring, up to the first one that is still being filled in.
+ * Only one thread flushes at a time: the flusher thread in thread-safe builds, the allocating thread in single-threaded ones.
+ * Stops recording if the trace file cannot be written.
+ */
+static void recordFlush(void)
+{
+    int64 t = tail;
+    int64 h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    int64 n = 0;
+
+    while (t + n != h && __atomic_load_n(&seqs[(t + n) % Recordslots], __ATOMIC_ACQUIRE) == t + n + 1)
+        n++;
+
+    // The completed events are contiguous in the ring apart from where it wraps around.
+    while (n)
+    {
+        word at = t % Recordslots;
+        word k = n < Recordslots - at ? n : Recordslots - at;
+
+        if (!recordWrite(&events[at], k * sizeof(event)))
+        {
+            trace(TraceErr, "record: Error: Could not write the trace file; recording stopped.\n");
+            __atomic_store_n(&recording, false, __ATOMIC_RELAXED);
+            return;
+        }
+
+        t += k;
+        n -= k;
+        __atomic_store_n(&tail, t, __ATOMIC_RELEASE);
+    }
+}
+
+#ifdef ALLOC_THREADS
+static void *recordFlusher(void *arg unused)
+{
+    struct timespec nap = {0, Recordnap};
+
+    while (__atomic_load_n(&flushing, __ATOMIC_ACQUIRE))
+    {
+        recordFlush();
+        nanosleep(&nap, NULL);
+    }
+
+    return NULL;
+}
+#endif
+
+/*
+ * Reserves the next event of the trace and stamps it with the current time; recordEnd fills in the rest.
+ * Waits while the ring is full.
+ * Returns the event's position, or Recordoff if recording stopped while waiting.
+ */
+int64 recordBegin(void)
+{
+    int64 pos = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+
+    while (pos - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= Recordslots)
+    {
+        if (!__atomic_load_n(&recording, __ATOMIC_RELAXED))
+            return Recordoff;
+#ifdef ALLOC_THREADS
+        sched_yield();
+#else
+        recordFlush();
+#endif
+    }
+
+    events[pos % Recordslots].ns = recordClock() - startns;
+    return pos;
+}
+
+/*
+ * Completes the event reserved at `pos` and hands it to the flusher.
+ */
+void recordEnd(int64 pos, int32 op, int64 bytes, int64 id, int64 arg)
+{
+    if (threadnum == 0)
+        threadnum = __atomic_add_fetch(&threads, 1, __ATOMIC_RELAXED);
+
+    event *e = &events[pos % Recordslots];
+    e->id = id;
+    e->arg = arg;
+    e->bytes = bytes;
+    e->op = op;
+    e->thread = threadnum;
+
+    __atomic_store_n(&seqs[pos % Recordslots], pos + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Starts logging every allocator call to the trace file `path`, which is created or truncated.
+ * The ring is mapped from the OS on first use rather than taken from the heap, so recording does not change the workload it records.
+ * Recording stops at exit if record_stop has not been called by then.
+ * record_start and record_stop are meant to be called while no other thread is allocating, e.g. at startup and shutdown.
+ * Returns false with errno set (ErrInval if recording is already on, otherwise as set by open or mmap).
+ */
+bool record_start(const char *path)
+{
+    static bool registered;
+
+    if (recording)
+    {
+        trace(TraceErr, "record: Error: Already recording.\n");
+        errno = ErrInval;
+        return false;
+    }
+
+    if (!events)
+    {
+        void *map = mmap(NULL, Recordslots * (sizeof(event) + sizeof(int64)), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED)
+            return false;
+        events = map;
+        seqs = (int64 *)(events + Recordslots);
+    }
+
+    recordfd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (recordfd < 0)
+        return false;
+
+    struct s_tracefile file = {.version = Recordversion, .eventbytes = sizeof(event)};
+    memcpy(file.magic, Recordmagic, sizeof(file.magic));
+    if (!recordWrite(&file, sizeof(file)))
+    {
+        close(recordfd);
+        recordfd = -1;
+        return false;
+    }
+
+    memset(seqs, 0, Recordslots * sizeof(int64));
+    head = 0;
+    tail = 0;
+    threads = 0;
+    startns = recordClock();
+
+#ifdef ALLOC_THREADS
+    flushing = true;
+    if (pthread_create(&flusher, NULL, recordFlusher, NULL))
+    {
+        flushing = false;
+        close(recordfd);
+        recordfd = -1;
+        errno = ErrNoMem;
+        return false;
+    }
+#endif
+
+    if (!registered)
+    {
+        atexit(record_stop);
+        registered = true;
+    }
+
+    trace(TraceOps, "record: Recording to %s.\n", path);
+    __atomic_store_n(&recording, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * Stops logging and writes out the events still in the ring.
+ * Calls that are still in progress in other threads when recording stops may be missing from the end of the trace.
+ */
+void record_stop(void)
+{
+    if (recordfd < 0)
+        return;
+
+    __atomic_store_n(&recording, false, __ATOMIC_RELAXED);
+
+#ifdef ALLOC_THREADS
+    __atomic_store_n(&flushing, false, __ATOMIC_RELEASE);
+    pthread_join(flusher, NULL);
+#endif
+
+    recordFlush();
+    close(recordfd);
+    recordfd = -1;
+
+    trace(TraceOps, "record: Stopped recording after %llu events.\n", tail);
+}
+
+#endif
@@ -0,0 +1,185 @@
+/*
+ * Bump-pointer regions layered on alloc().
+ * A region hands out memory from large heap blocks by advancing a pointer, and never frees individual objects:
+ * everything allocated from it is released together by region_reset or region_destroy, with one freealloc per block.
+ * This suits request-scoped data that is allocated in bursts and dropped all at once.
+ */
+
+#include "main.h"
+
+// Start of every region block: the link to the previous block and the block's usable size.
+// The header does not necessarily end on an aligned address, so each block is taken with Regionalign - 1 bytes of slack behind it.
+struct s_regionblock
+{
+    struct s_regionblock *prev;
+    word bytes;
+};
+
+typedef struct s_regionblock regionblock;
+
+#define alignUp(p, a) ((char *)(((size_t)(p) + (a) - 1) & ~(size_t)((a) - 1)))
+
+// First aligned byte and end of the usable space of block `b`.
+#define blockStart(b) alignUp((b) + 1, Regionalign)
+#define blockEnd(b) (blockStart(b) + (b)->bytes)
+
+/*
+ * Creates a region that takes `block_bytes`-byte blocks from the heap, or Regionbytes-byte blocks if it is 0.
+ * No block is taken until the first region_alloc.
+ * Returns the new region, or NULL with errno set to ErrNoMem.
+ */
+region *region_new(size_t block_bytes)
+{
+    region *r = alloc(sizeof(region));
+    if (!r)
+        return NULL;
+
+    r->blocks = NULL;
+    r->bump = NULL;
+    r->end = NULL;
+    r->bytes = block_bytes ? block_bytes : Regionbytes;
+#ifdef ALLOC_THREADS
+    pthread_mutex_init(&r->lock, NULL);
+#endif
+
+    trace(TraceOps, "region: Created region %p with %lu-byte blocks.\n", (void *)r, r->bytes);
+    return r;
+}
+
+/*
+ * Takes a block with room for at least `bytes` bytes from the heap and links it into region `r`.
+ * Returns the block, or NULL with errno set to ErrNoMem if the heap is out of memory or `bytes` is too large for any block.
+ */
+static regionblock *regionGrow(region *r, word bytes)
+{
+    // The header and the alignment slack are added to the size, which must not wrap around to a short block.
+    if (bytes > (size_t)-1 - sizeof(regionblock) - (Regionalign - 1))
+    {
+        trace(TraceOps, "region: Request for %lu bytes is too large.\n", bytes);
+        reterr(ErrNoMem);
+    }
+
+    regionblock *b = alloc(sizeof(regionblock) + Regionalign - 1 + bytes);
+    if (!b)
+        return NULL;
+
+    b->prev = r->blocks;
+    b->bytes = bytes;
+    r->blocks = b;
+
+    trace(TraceAll, "region: Region %p took a %lu-byte block at %p.\n", (void *)r, bytes, (void *)b);
+    return b;
+}
+
+/*
+ * Allocates `bytes` bytes from region `r`, aligned to Regionalign.
+ * The common case only advances the bump pointer. When the current block is exhausted a fresh one is taken;
+ * a request larger than a regular block gets a block of its own and leaves the current one in use.
+ * Returns NULL with errno set (ErrInval for a zero size, ErrNoMem if the heap is full).
+ */
+void *region_alloc(region *r, size_t bytes)
+{
+    if (bytes == 0)
+    {
+        trace(TraceErr, "region: Error: Zero-byte allocation.\n");
+        reterr(ErrInval);
+    }
+
+    void *ptr = NULL;
+
+    lockregion(r);
+    char *p = alignUp(r->bump, Regionalign);
+    if (r->bump && p <= r->end && (size_t)(r->end - p) >= bytes)
+    {
+        ptr = p;
+        r->bump = p + bytes;
+    }
+    else if (bytes > r->bytes)
+    {
+        // Link the oversized block behind the current one so the current block keeps serving small requests.
+        regionblock *b = regionGrow(r, bytes);
+        if (b && b->prev)
+        {
+            r->blocks = b->prev;
+            b->prev = ((regionblock *)r->blocks)->prev;
+            ((regionblock *)r->blocks)->prev = b;
+        }
+        ptr = b ? blockStart(b) : NULL;
+    }
+    else
+    {
+        regionblock *b = regionGrow(r, r->bytes);
+        if (b)
+        {
+            ptr = blockStart(b);
+            r->bump = (char *)ptr + bytes;
+            r->end = blockEnd(b);
+        }
+    }
+    unlockregion(r);
+
+    return ptr;
+}
+
+/*
+ * Frees everything allocated from region `r` at once, with one freealloc per block.
+ * The most recent regular-sized block is kept and rewound, so a region reused across requests does not go back to the heap each time.
+ * All pointers previously returned by region_alloc become invalid.
+ */
+void region_reset(region *r)
+{
+    lockregion(r);
+
+    regionblock *keep = NULL;
+    regionblock *b = r->blocks;
+    while (b)
+    {
+        regionblock *prev = b->prev;
+        if (!keep && b->bytes == r->bytes)
+            keep = b;
+        else
+            freealloc(b);
+        b = prev;
+    }
+
+    if (keep)
+    {
+        keep->prev = NULL;
+        r->bump = blockStart(keep);
+        r->end = blockEnd(keep);
+    }
+    else
+    {
+        r->bump = NULL;
+        r->end = NULL;
+    }
+    r->blocks = keep;
+
+    unlockregion(r);
+    trace(TraceOps, "region: Reset region %p.\n", (void *)r);
+}
+
+/*
+ * Frees region `r` and every block it took from the heap.
+ * All pointers previously returned by region_alloc become invalid.
+ */
+void region_destroy(region *r)
+{
+    if (r == NULL)
+        return;
+
+    trace(TraceOps, "region: Destroying region %p.\n", (void *)r);
+
+    regionblock *b = r->blocks;
+    while (b)
+    {
+        regionblock *prev = b->prev;
+        freealloc(b);
+        b = prev;
+    }
+
+#ifdef ALLOC_THREADS
+    pthread_mutex_destroy(&r->lock);
+#endif
+    freealloc(r);
+}
@@ -0,0 +1,382 @@
+/*
+ * Replays a trace captured with the recorder (see record.c) against this build of the allocator (`make replay`).
+ * Build-time settings are chosen when building the tool, e.g. `make replay ARENAS=4 ALIGN=16 HEAP=16777216`;
+ * search policies and the mmap threshold are chosen on the command line, so one build compares them all.
+ * Every policy is replayed in a child process of its own, so each starts from an empty heap.
+ * The calls of each recorded thread are replayed in a thread of their own, in their recorded order; a free waits until
+ * the allocation it refers to has been replayed, so blocks can still move between threads as they did when recorded.
+ * Reported per policy: wall time, time per call, failed calls, and fragmentation at the recorded peak of live memory.
+ */
+
+#include "main.h"
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// The calls of the recorded threads are replayed concurrently.
+#ifndef ALLOC_THREADS
+#error "replay.c needs the thread-safe allocator (-DALLOC_THREADS); build it with `make replay`"
+#endif
+
+#define Nodep (~(word)0) // No earlier event produced the block an event refers to.
+
+// The trace and what replaying it needs, shared by the replay threads.
+struct s_replay
+{
+    const event *events;
+    word n;           // Number of events.
+    word *dep;        // Event that produced the block a free or realloc refers to, or Nodep.
+    word *next;       // Next event of the same thread, or n.
+    word *first;      // First event of each thread, indexed by thread number (from 1).
+    int32 threads;    // Highest thread number in the trace.
+    void **ptrs;      // Block each event's call returned in the replay.
+    bool *done;       // Set once an event has been replayed.
+    size_t threshold; // mmap threshold of the replay.
+    word peakat;      // Event after which the live memory in the heap was highest.
+    size_t peaklive;  // Live bytes in the heap at that point, leaving out directly mapped blocks.
+    size_t peakfoot;  // Footprint of the heap just after replaying it.
+    word failed;      // Calls that failed in the replay.
+};
+
+typedef struct s_replay replay;
+
+// Per-thread argument of the replay threads.
+struct s_worker
+{
+    replay *r;
+    int32 thread;
+};
+
+static const struct
+{
+    const char *name;
+    int32 policy;
+} policies[] = {
+    {"bins", FitBins},
+    {"first", FitFirst},
+    {"next", FitNext},
+    {"best", FitBest},
+#ifdef ALLOC_FREEMAP
+    {"map", FitMap},
+#endif
+};
+
+// Anonymous memory for the replay's own tables, so they do not disturb the heap being measured.
+static void *replayMap(size_t bytes)
+{
+    void *p = mmap(NULL, bytes ? bytes : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        perror("replay: mmap");
+        exit(1);
+    }
+    return p;
+}
+
+static inline int64 now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Footprint of the heap: the part of every chunk below its high-water mark, as in bench.c.
+static size_t heapFootprint(void)
+{
+    size_t bytes = 0;
+
+    for (word i = 0; i < Arenas; i++)
+    {
+        arena *a = &arenas[i];
+
+        lockarena(a);
+        for (chunk *c = a->tail ? &a->first : NULL; c; c = c->next)
+            bytes += c->clean - (char *)c->base;
+        unlockarena(a);
+    }
+
+    return bytes;
+}
+
+/*
+ * Maps the trace file at `path` and checks its header.
+ * Returns its events and stores their number in `n`; exits on an unreadable or foreign file.
+ */
+static const event *traceLoad(const char *path, word *n)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        perror(path);
+        exit(1);
+    }
+
+    const struct s_tracefile *file = NULL;
+    if ((size_t)st.st_size >= sizeof(*file))
+        file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (!file || file == MAP_FAILED || memcmp(file->magic, Recordmagic, sizeof(file->magic)) ||
+        file->version != Recordversion || file->eventbytes != sizeof(event))
+    {
+        fprintf(stderr, "replay: %s is not a trace from this recorder\n", path);
+        exit(1);
+    }
+
+    *n = (st.st_size - sizeof(*file)) / sizeof(event);
+    return (const event *)(file + 1);
+}
+
+// Bytes the block produced by event `e` was asked for.
+static size_t eventBytes(const event *e)
+{
+    return e->op == RecCalloc ? e->arg * e->bytes : e->bytes;
+}
+
+// Whether the block produced by event `e` is served from the heap rather than mapped directly, as the entry points decide it.
+// `from` is whether the block a realloc resizes was in the heap: a mapped block stays mapped whatever its new size.
+static bool eventInHeap(const replay *r, const event *e, bool from)
+{
+    if (e->op == RecAligned && e->arg > ALLOC_ALIGN)
+        return true;
+    if (e->op == RecRealloc && !from)
+        return false;
+    return eventBytes(e) < r->threshold;
+}
+
+/*
+ * Links every free and realloc to the event that produced its block, chains each thread's events,
+ * and finds the point where the live memory in the heap peaks.
+ * Recorded addresses are reused once freed, so a hash table maps each address to the latest event that returned it.
+ * Frees of blocks allocated before recording started have no producer and are skipped in the replay.
+ */
+static void traceLink(replay *r)
+{
+    word slots = 1;
+    while (slots < 2 * r->n)
+        slots *= 2;
+
+    int64 *keys = replayMap(slots * sizeof(int64));
+    word *vals = replayMap(slots * sizeof(word));
+    word *last = NULL;
+    bool *inheap = replayMap(r->n * sizeof(bool));
+    size_t live = 0;
+
+    r->dep = replayMap(r->n * sizeof(word));
+    r->next = replayMap(r->n * sizeof(word));
+    r->ptrs = replayMap(r->n * sizeof(void *));
+    r->done = replayMap(r->n * sizeof(bool));
+
+    for (word i = 0; i < r->n; i++)
+        if (r->events[i].thread > r->threads)
+            r->threads = r->events[i].thread;
+    r->first = replayMap((r->threads + 1) * sizeof(word));
+    last = replayMap((r->threads + 1) * sizeof(word));
+    for (int32 t = 0; t <= r->threads; t++)
+        r->first[t] = r->n;
+
+    for (word i = 0; i < r->n; i++)
+    {
+        const event *e = &r->events[i];
+
+        int32 t = e->thread;
+        r->next[i] = r->n;
+        if (r->first[t] == r->n)
+            r->first[t] = i;
+        else
+            r->next[last[t]] = i;
+        last[t] = i;
+
+        // The block this event consumes: freed, or resized (unless the resize failed and left it in place).
+        r->dep[i] = Nodep;
+        int64 used = e->op == RecFree ? e->id : e->op == RecRealloc && e->id ? e->arg : 0;
+        if (used)
+        {
+            word h = (word)(used * 0x9e3779b97f4a7c15ull) & (slots - 1);
+            while (keys[h] && keys[h] != used)
+                h = (h + 1) & (slots - 1);
+            if (keys[h] == used && vals[h] != Nodep)
+            {
+                r->dep[i] = vals[h];
+                if (inheap[vals[h]])
+                    live -= eventBytes(&r->events[vals[h]]);
+                vals[h] = Nodep;
+            }
+        }
+
+        // The block this event produces.
+        if (e->op != RecFree && e->id)
+        {
+            word h = (word)(e->id * 0x9e3779b97f4a7c15ull) & (slots - 1);
+            while (keys[h] && keys[h] != e->id)
+                h = (h + 1) & (slots - 1);
+            keys[h] = e->id;
+            vals[h] = i;
+
+            inheap[i] = eventInHeap(r, e, r->dep[i] == Nodep || inheap[r->dep[i]]);
+            if (inheap[i])
+                live += eventBytes(e);
+
+            if (live > r->peaklive)
+            {
+                r->peaklive = live;
+                r->peakat = i;
+            }
+        }
+    }
+
+    munmap(keys, slots * sizeof(int64));
+    munmap(vals, slots * sizeof(word));
+    munmap(last, (r->threads + 1) * sizeof(word));
+    munmap(inheap, r->n * sizeof(bool));
+}
+
+// Replays event `i`, once the event it depends on has been replayed (by whichever thread that is).
+static void replayEvent(replay *r, word i)
+{
+    const event *e = &r->events[i];
+    word d = r->dep[i];
+    void *ptr = NULL;
+
+    if (d != Nodep)
+        while (!__atomic_load_n(&r->done[d], __ATOMIC_ACQUIRE))
+            sched_yield();
+
+    switch (e->op)
+    {
+    case RecAlloc:
+        ptr = alloc(e->bytes);
+        break;
+    case RecAligned:
+        ptr = alloc_aligned(e->bytes, e->arg);
+        break;
+    case RecCalloc:
+        ptr = calloc_block(e->arg, e->bytes);
+        break;
+    case RecRealloc:
+        // A resize that failed when recorded changed nothing; one of a block from before recording started becomes an allocation.
+        if (e->id)
+            ptr = d != Nodep ? realloc_block(r->ptrs[d], e->bytes) : alloc(e->bytes);
+        break;
+    case RecFree:
+        if (d != Nodep)
+            freealloc(r->ptrs[d]);
+        break;
+    }
+
+    if (!ptr && e->op != RecFree && (e->op != RecRealloc || e->id))
+        __atomic_fetch_add(&r->failed, 1, __ATOMIC_RELAXED);
+    r->ptrs[i] = ptr;
+    __atomic_store_n(&r->done[i], true, __ATOMIC_RELEASE);
+
+    if (i == r->peakat)
+        r->peakfoot = heapFootprint();
+}
+
+static void *replayThread(void *arg)
+{
+    struct s_worker *w = arg;
+    replay *r = w->r;
+
+    for (word i = r->first[w->thread]; i < r->n; i = r->next[i])
+        replayEvent(r, i);
+
+    return NULL;
+}
+
+/*
+ * Replays the whole trace with search policy `p` and prints the results.
+ * Called in a fresh child process, so the heap starts out empty.
+ */
+static void replayRun(replay *r, word p)
+{
+    pthread_t *threads = replayMap((r->threads + 1) * sizeof(pthread_t));
+    struct s_worker *workers = replayMap((r->threads + 1) * sizeof(struct s_worker));
+
+    setpolicy(policies[p].policy);
+
+    int64 start = now();
+    for (int32 t = 1; t <= r->threads; t++)
+    {
+        workers[t] = (struct s_worker){r, t};
+        pthread_create(&threads[t], NULL, replayThread, &workers[t]);
+    }
+    for (int32 t = 1; t <= r->threads; t++)
+        pthread_join(threads[t], NULL);
+    double secs = (now() - start) / 1e9;
+
+    double frag = r->peakfoot ? 100.0 * (1.0 - (double)r->peaklive / r->peakfoot) : 0.0;
+    printf("%-8s %10.3f %10.1f %10lu %12zu %12zu %9.1f%%\n", policies[p].name, secs, r->n ? secs * 1e9 / r->n : 0.0,
+           r->failed, r->peaklive, r->peakfoot, frag < 0 ? 0.0 : frag);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: memory_replay [-p policy] [-m mmap-threshold] trace\npolicies:");
+    for (word p = 0; p < sizeof(policies) / sizeof(policies[0]); p++)
+        fprintf(stderr, " %s", policies[p].name);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *only = NULL;
+    size_t threshold = ALLOC_MMAP_THRESHOLD;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:m:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            only = optarg;
+            break;
+        case 'm':
+            threshold = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    bool known = !only;
+    for (word p = 0; p < sizeof(policies) / sizeof(policies[0]); p++)
+        known |= only && !strcmp(only, policies[p].name);
+    if (!known || optind != argc - 1)
+        usage();
+
+    replay r = {.threshold = threshold};
+    setmmapthreshold(threshold);
+    r.events = traceLoad(argv[optind], &r.n);
+    traceLink(&r);
+
+    double span = r.n ? r.events[r.n - 1].ns / 1e9 : 0.0;
+    printf("%lu events from %d thread(s) over %.3f s recorded, %d arena(s)\n", r.n, r.threads, span, Arenas);
+    printf("%-8s %10s %10s %10s %12s %12s %10s\n", "policy", "seconds", "ns/call", "failed", "peak live", "footprint", "frag@peak");
+
+    for (word p = 0; p < sizeof(policies) / sizeof(policies[0]); p++)
+    {
+        if (only && strcmp(only, policies[p].name))
+            continue;
+
+        fflush(stdout);
+
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            replayRun(&r, p);
+            fflush(stdout);
+            _exit(0);
+        }
+
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            printf("%-8s failed\n", policies[p].name);
+    }
+
+    return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Machine-readable heap snapshots.
+ * print_memory_layout() prints one line per block, which is slow on a fragmented heap and cannot be parsed.
+ * alloc_snapshot() instead encodes the block map as compact runs (see struct s_snapshot) into memory, holding each arena's
+ * lock only while its blocks are encoded and doing no I/O; memory_heatmap (heatmap.c) renders a snapshot offline.
+ */
+
+#include "main.h"
+
+// Where a snapshot is being encoded. Bytes past `end` are counted but not stored, so the caller learns the size it needs.
+struct s_cursor
+{
+    char *p;
+    char *end;
+    size_t bytes;
+};
+
+typedef struct s_cursor cursor;
+
+static void putBytes(cursor *c, const void *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++, c->bytes++)
+    {
+        if (c->p < c->end)
+            *c->p++ = ((const char *)src)[i];
+    }
+}
+
+// Appends `v` as an unsigned LEB128 varint: 7 bits per byte, low bits first, the top bit set on all but the last byte.
+static void putVarint(cursor *c, int64 v)
+{
+    int8 b;
+    do
+    {
+        b = v & 0x7f;
+        v >>= 7;
+        if (v)
+            b |= 0x80;
+        putBytes(c, &b, 1);
+    } while (v);
+}
+
+// Appends a run of `blocks` blocks totalling `words` words, all allocated or all free.
+static void putRun(cursor *c, word words, word blocks, bool alloced)
+{
+    putVarint(c, (int64)words << 1 | alloced);
+    putVarint(c, blocks);
+}
+
+/*
+ * Appends chunk `ch` of arena `i`: its address and size, then its blocks merged into runs.
+ * A zero-sized header ends the chunk early, as the rest of it cannot be walked.
+ */
+static void putChunk(cursor *c, word i, chunk *ch)
+{
+    putVarint(c, i + 1);
+    putVarint(c, (size_t)ch->base);
+    putVarint(c, ch->words);
+
+    header *hdr = ch->base;
+    word offset = 0, words = 0, blocks = 0;
+    bool alloced = false;
+
+    while (offset < ch->words && hdr->w)
+    {
+        if (blocks && hdr->alloced != alloced)
+        {
+            putRun(c, words, blocks, alloced);
+            words = 0;
+            blocks = 0;
+        }
+
+        alloced = hdr->alloced;
+        words += hdr->w;
+        blocks++;
+
+        offset += hdr->w;
+        hdr = (header *)((char *)hdr + hdr->w * Wordbytes);
+    }
+
+    if (blocks)
+        putRun(c, words, blocks, alloced);
+    putVarint(c, 0);
+}
+
+/*
+ * Writes a snapshot of the block map of every arena to `buf`, which has room for `bytes` bytes.
+ * Each arena is locked only while its own chunks are encoded, so allocations in other arenas carry on meanwhile.
+ * An arena that has never been used appears as one free block spanning its slice of memspace.
+ * Returns the size of the whole snapshot; if that is more than `bytes`, only the first `bytes` bytes were written.
+ */
+size_t alloc_snapshot(void *buf, size_t bytes)
+{
+    cursor c = {buf, (char *)buf + bytes, 0};
+
+    struct s_snapshot head = {.version = Snapshotversion, .wordbytes = Wordbytes};
+    memcpy(head.magic, Snapshotmagic, sizeof(head.magic));
+    putBytes(&c, &head, sizeof(head));
+
+    for (word i = 0; i < Arenas; i++)
+    {
+        arena *a = &arenas[i];
+
+        lockarena(a);
+        if (a->tail)
+        {
+            for (chunk *ch = &a->first; ch; ch = ch->next)
+                putChunk(&c, i, ch);
+        }
+        else
+        {
+            putVarint(&c, i + 1);
+            putVarint(&c, (size_t)arenaBase(i));
+            putVarint(&c, arenaWords(i));
+            putRun(&c, arenaWords(i), 1, false);
+            putVarint(&c, 0);
+        }
+        unlockarena(a);
+    }
+
+    putVarint(&c, 0);
+
+    trace(TraceOps, "snapshot: Encoded %zu bytes.\n", c.bytes);
+    return c.bytes;
+}
+
+/*
+ * Writes a snapshot of the block map (see alloc_snapshot) to file descriptor `fd`.
+ * The snapshot is encoded into memory mapped from the OS, not taken from the heap, and written out once no arena is locked,
+ * so a slow file, pipe or socket never holds up allocations.
+ * Returns false with errno set (ErrNoMem if no memory could be mapped, otherwise as set by write).
+ */
+bool alloc_snapshot_fd(int fd)
+{
+    size_t size = 64 * 1024;
+
+    for (;;)
+    {
+        char *buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED)
+        {
+            errno = ErrNoMem;
+            return false;
+        }
+
+        size_t bytes = alloc_snapshot(buf, size);
+        if (bytes > size)
+        {
+            // The heap may change again before the next attempt, so leave it room to grow.
+            munmap(buf, size);
+            size = 2 * bytes;
+            continue;
+        }
+
+        for (size_t done = 0; done < bytes;)
+        {
+            ssize_t n = write(fd, buf + done, bytes - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                munmap(buf, size);
+                return false;
+            }
+            done += n;
+        }
+
+        munmap(buf, size);
+        return true;
+    }
+}
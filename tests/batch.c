@@ -0,0 +1,39 @@
+/*
+ * free_batch() with deferred coalescing: a block already parked in a fast bin is still marked allocated,
+ * so the batch must not join it with its neighbour and free it a second time while it is still parked.
+ */
+
+#include "check.h"
+
+#define Allocs 8
+
+// Whether the blocks at `p` and `q` overlap.
+static bool overlap(char *p, char *q)
+{
+    return p < q + alloc_usable_size(q) && q < p + alloc_usable_size(p);
+}
+
+int main(int unused argc, char **unused argv)
+{
+    char *a = alloc(32), *b = alloc(32);
+    check(a && b);
+    size_t pair = 2 * alloc_usable_size(a) + sizeof(header); // What the two would hold joined.
+    freealloc(b);
+
+    void *ptrs[] = {a, b};
+    free_batch(ptrs, 2);
+
+    // Every block handed out afterwards must be a block of its own, also from the bins for one block and for the pair.
+    char *blocks[Allocs];
+    for (int i = 0; i < Allocs; i++)
+    {
+        check(blocks[i] = alloc(i % 2 ? pair : 32));
+        for (int k = 0; k < i; k++)
+            check(!overlap(blocks[i], blocks[k]));
+    }
+    for (int i = 0; i < Allocs; i++)
+        freealloc(blocks[i]);
+
+    printf("batch: ok\n");
+    return 0;
+}
@@ -0,0 +1,21 @@
+/*
+ * Shared helper of the regression tests in tests/ (`make test`).
+ * Every test is a small program linked against its own build of the allocator; it exits with status 1 on the first failed check.
+ */
+
+#ifndef TESTS_CHECK_H
+#define TESTS_CHECK_H
+
+#include "../main.h"
+
+#define check(cond)                                                                      \
+    do                                                                                   \
+    {                                                                                    \
+        if (!(cond))                                                                     \
+        {                                                                                \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);    \
+            exit(1);                                                                     \
+        }                                                                                \
+    } while (0)
+
+#endif
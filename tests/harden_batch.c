@@ -0,0 +1,69 @@
+/*
+ * free_batch() in hardened mode: a block freed twice, through the batch or alongside freealloc(), must abort the process
+ * wherever the first free left it (quarantine or thread cache), just as a second freealloc() would.
+ */
+
+#include "check.h"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+// Runs `test` in a child process and returns whether it aborted.
+static bool aborts(void (*test)(void))
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        freopen("/dev/null", "w", stderr);
+        test();
+        exit(0);
+    }
+
+    int status;
+    check(waitpid(pid, &status, 0) == pid);
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+static void batchValid(void)
+{
+    void *ptrs[8];
+    for (int i = 0; i < 8; i++)
+        ptrs[i] = alloc(48);
+    free_batch(ptrs, 8);
+}
+
+// The first free parks the block in the quarantine.
+static void batchAfterFree(void)
+{
+    void *p = alloc(48);
+    freealloc(p);
+    free_batch(&p, 1);
+}
+
+static void batchTwice(void)
+{
+    void *p = alloc(48), *q = alloc(48);
+    void *ptrs[] = {p, q, p};
+    free_batch(ptrs, 3);
+}
+
+// Enough later frees push the block out of the quarantine and into the thread cache.
+static void batchAfterCached(void)
+{
+    void *p = alloc(48);
+    freealloc(p);
+    for (int i = 0; i < Quarantineslots; i++)
+        freealloc(alloc(48));
+    free_batch(&p, 1);
+}
+
+int main(int unused argc, char **unused argv)
+{
+    check(!aborts(batchValid));
+    check(aborts(batchAfterFree));
+    check(aborts(batchTwice));
+    check(aborts(batchAfterCached));
+
+    printf("harden_batch: ok\n");
+    return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * Requests too large for any block must fail with ErrNoMem instead of wrapping around in the size arithmetic
+ * and handing out a small block as if it were the size asked for.
+ */
+
+#include "check.h"
+
+// Checks that `ptr` is the NULL of a request that was too large.
+#define checkTooLarge(ptr)                   \
+    do                                       \
+    {                                        \
+        errno = 0;                           \
+        void *ptr_ = (ptr);                  \
+        check(ptr_ == NULL);                 \
+        check(errno == ErrNoMem);            \
+    } while (0)
+
+int main(int unused argc, char **unused argv)
+{
+    size_t huge[] = {(size_t)-1, (size_t)-1 - 64, (size_t)-1 / 2, (size_t)-1 - 4096};
+
+    for (word i = 0; i < sizeof(huge) / sizeof(huge[0]); i++)
+    {
+        // Through a direct mapping, and through the arenas with the mmap threshold out of the way.
+        checkTooLarge(alloc(huge[i]));
+        checkTooLarge(calloc_block(1, huge[i]));
+        checkTooLarge(alloc_aligned(huge[i], 64));
+        checkTooLarge(alloc_aligned(huge[i], 4096));
+        checkTooLarge(alloc_on_node(huge[i], 0));
+
+        setmmapthreshold((size_t)-1);
+        checkTooLarge(alloc(huge[i]));
+        checkTooLarge(calloc_block(1, huge[i]));
+        setmmapthreshold(ALLOC_MMAP_THRESHOLD);
+    }
+
+    // A failed resize leaves both kinds of block as they were.
+    size_t sizes[] = {100, 1024 * 1024};
+    for (word k = 0; k < 2; k++)
+    {
+        char *block = alloc(sizes[k]);
+        check(block);
+        memset(block, 0x5a, sizes[k]);
+
+        checkTooLarge(realloc_block(block, (size_t)-1));
+        checkTooLarge(realloc_block(block, (size_t)-1 - 64));
+        check(alloc_usable_size(block) >= sizes[k]);
+        for (size_t i = 0; i < sizes[k]; i++)
+            check(block[i] == 0x5a);
+
+        freealloc(block);
+    }
+
+    puts("overflow: ok");
+    return 0;
+}
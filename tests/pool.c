@@ -0,0 +1,49 @@
+/*
+ * Object pools: every slot is aligned like a block from alloc(), whatever the object size,
+ * and objects keep their contents while slots are reused and slabs are added.
+ */
+
+#include "check.h"
+
+#define Objects 2000
+
+static void *objs[Objects];
+
+// Fills a pool well past its first slab, twice, checking the alignment and contents of every object.
+static void fill(int32 size)
+{
+    pool *p = pool_create(size);
+    check(p);
+
+    for (int round = 0; round < 2; round++)
+    {
+        for (int i = 0; i < Objects; i++)
+        {
+            check(objs[i] = pool_alloc(p));
+            check((size_t)objs[i] % ALLOC_ALIGN == 0);
+            memset(objs[i], i, size);
+        }
+        for (int i = 0; i < Objects; i++)
+        {
+            unsigned char *obj = objs[i];
+            for (int32 k = 0; k < size; k++)
+                check(obj[k] == (unsigned char)i);
+            pool_free(p, obj);
+        }
+    }
+
+    pool_destroy(p);
+}
+
+int main(int unused argc, char **unused argv)
+{
+    static const int32 sizes[] = {1, 8, 12, 16, 24, 40, 100, 3000};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        fill(sizes[i]);
+
+    check(pool_create(0) == NULL && errno == ErrInval);
+    check(pool_create(Slabmaxobj + 1) == NULL && errno == ErrInval);
+
+    printf("pool: ok\n");
+    return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Run with LD_PRELOAD=./libmemalloc.so: the C library entry points must reject sizes that overflow with ENOMEM,
+ * and the obsolete page-aligned ones must be served by the library too, not by glibc's heap.
+ * Built against the C library only, so the calls go wherever the dynamic linker binds them.
+ */
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define check(cond)                                                                      \
+    do                                                                                   \
+    {                                                                                    \
+        if (!(cond))                                                                     \
+        {                                                                                \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);    \
+            exit(1);                                                                     \
+        }                                                                                \
+    } while (0)
+
+// Kept in a volatile so the compiler cannot see the sizes and fold the calls away.
+static volatile size_t huge = SIZE_MAX;
+
+int main(void)
+{
+    void *ptr;
+
+    errno = 0;
+    check(malloc(huge) == NULL && errno == ENOMEM);
+    errno = 0;
+    check(malloc(huge - 64) == NULL && errno == ENOMEM);
+    errno = 0;
+    check(calloc(1, huge) == NULL && errno == ENOMEM);
+    errno = 0;
+    check(aligned_alloc(64, huge - 64) == NULL && errno == ENOMEM);
+    check(posix_memalign(&ptr, 64, huge) == ENOMEM);
+
+    char *block = malloc(1024 * 1024);
+    check(block);
+    memset(block, 0x5a, 1024 * 1024);
+    errno = 0;
+    check(realloc(block, huge) == NULL && errno == ENOMEM);
+    check(malloc_usable_size(block) >= 1024 * 1024 && block[1024 * 1024 - 1] == 0x5a);
+    free(block);
+
+    // The library's malloc_usable_size reports 0 for a block it did not allocate.
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    void *blocks[] = {memalign(64, 100), valloc(100), pvalloc(100), pvalloc(0), pvalloc(page + 1)};
+    size_t sizes[] = {100, 100, page, page, 2 * page};
+    for (size_t i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++)
+    {
+        check(blocks[i] && malloc_usable_size(blocks[i]) >= sizes[i]);
+        check((size_t)blocks[i] % (i ? page : 64) == 0);
+        free(blocks[i]);
+    }
+    errno = 0;
+    check(pvalloc(huge) == NULL && errno == ENOMEM);
+
+    puts("preload: ok");
+    return 0;
+}
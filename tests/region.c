@@ -0,0 +1,36 @@
+/*
+ * Region requests so large that the block header and alignment slack would wrap their size around must fail,
+ * for oversized requests and for regions whose regular block size is itself too large.
+ */
+
+#include "check.h"
+
+int main(int unused argc, char **unused argv)
+{
+    region *r = region_new(0);
+    check(r);
+
+    size_t huge[] = {(size_t)-1, (size_t)-1 - sizeof(void *), (size_t)-1 - Regionalign, (size_t)-1 / 2};
+    for (word i = 0; i < sizeof(huge) / sizeof(huge[0]); i++)
+    {
+        errno = 0;
+        check(region_alloc(r, huge[i]) == NULL);
+        check(errno == ErrNoMem);
+    }
+
+    // The region still works, and its blocks hold what they were asked for.
+    char *p = region_alloc(r, 1000);
+    check(p && (size_t)p % Regionalign == 0);
+    memset(p, 0x5a, 1000);
+    region_destroy(r);
+
+    region *big = region_new((size_t)-1 - 8);
+    check(big);
+    errno = 0;
+    check(region_alloc(big, 16) == NULL);
+    check(errno == ErrNoMem);
+    region_destroy(big);
+
+    puts("region: ok");
+    return 0;
+}
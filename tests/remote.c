@@ -0,0 +1,90 @@
+/*
+ * Remote frees: blocks freed by a thread of another arena must not stay queued once their owner stops allocating.
+ * alloc_stats() and alloc_trim() drain the stacks themselves, and a thread drains its arena's stack when it exits.
+ */
+
+#include "check.h"
+
+#define Blocks 1000
+
+static void *blocks[Blocks];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t change = PTHREAD_COND_INITIALIZER;
+static int step; // 1 once the owner has allocated, 2 once the main thread has freed and checked.
+
+// Allocates the blocks from this thread's own arena, then waits until the main thread has freed them and exits.
+static void *owner(void *arg unused)
+{
+    for (int i = 0; i < Blocks; i++)
+        check(blocks[i] = alloc(64));
+
+    pthread_mutex_lock(&lock);
+    step = 1;
+    pthread_cond_broadcast(&change);
+    while (step < 2)
+        pthread_cond_wait(&change, &lock);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+// Starts an owner thread, which takes the next arena, and frees its blocks from the main thread.
+static pthread_t handOver(void)
+{
+    pthread_t t;
+    step = 0;
+    check(pthread_create(&t, NULL, owner, NULL) == 0);
+
+    pthread_mutex_lock(&lock);
+    while (step < 1)
+        pthread_cond_wait(&change, &lock);
+    pthread_mutex_unlock(&lock);
+
+    for (int i = 0; i < Blocks; i++)
+        freealloc(blocks[i]);
+    return t;
+}
+
+static void resume(void)
+{
+    pthread_mutex_lock(&lock);
+    step = 2;
+    pthread_cond_broadcast(&change);
+    pthread_mutex_unlock(&lock);
+}
+
+int main(int unused argc, char **unused argv)
+{
+    allocstats before, after;
+
+    // Gives the main thread its arena before the owner takes the next one.
+    freealloc(alloc(64));
+    alloc_stats(&before);
+
+    // The owner allocates nothing more before it exits.
+    pthread_t t = handOver();
+    resume();
+    check(pthread_join(t, NULL) == 0);
+    for (word i = 0; i < Arenas; i++)
+        check(arenas[i].remote == NULL);
+
+    // The owner is still running but does not allocate, so only alloc_stats can drain its stack.
+    t = handOver();
+    alloc_stats(&after);
+    check(after.allocblocks == before.allocblocks);
+    for (word i = 0; i < Arenas; i++)
+        check(arenas[i].remote == NULL);
+    resume();
+    check(pthread_join(t, NULL) == 0);
+
+    // Nor can anything else release the pages of an idle owner's blocks.
+    alloc_trim();
+    t = handOver();
+    check(alloc_trim() >= Blocks * 64 / 2);
+    for (word i = 0; i < Arenas; i++)
+        check(arenas[i].remote == NULL);
+    resume();
+    check(pthread_join(t, NULL) == 0);
+
+    printf("remote: ok\n");
+    return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * An in-place grow must only mark the part of the absorbed free block it keeps as used: the split-off surplus has never
+ * been touched, so calloc_block can still skip clearing it and its pages are still counted as never used.
+ */
+
+#include "check.h"
+
+int main(int unused argc, char **unused argv)
+{
+    // The first block of a fresh heap is followed by the rest of its chunk as one untouched free block.
+    char *p = alloc(100);
+    check(p);
+    chunk *c = chunkOf((header *)p - 1);
+    check(c);
+    memset(p, 0x5a, 100);
+    char *before = c->clean;
+    check(before < p + 1024);
+
+    char *q = realloc_block(p, 200);
+    check(q == p);
+    check(alloc_usable_size(q) >= 200);
+    for (word i = 0; i < 100; i++)
+        check(q[i] == 0x5a);
+
+    // Only the grown block, and the header and free-list node of the surplus behind it, may have been marked.
+    check(c->clean >= q + 200);
+    check(c->clean < q + 1024);
+
+    // The surplus is still known to be zero.
+    char *z = calloc_block(1, 100000);
+    check(z);
+    for (word i = 0; i < 100000; i++)
+        check(z[i] == 0);
+
+    freealloc(z);
+    freealloc(q);
+
+    puts("resize: ok");
+    return 0;
+}
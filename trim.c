@@ -0,0 +1,222 @@
+/*
+ * Releasing idle heap memory to the OS.
+ * Freed memory stays in the heap's free blocks with its pages resident, so after a load spike the resident set never shrinks
+ * back to the working set. alloc_trim() hands every page that lies entirely inside a free block back to the OS with madvise,
+ * and marks it in its chunk's page map so later trims skip it; allocating over such a page clears its bit again (see pagesUsed).
+ * In thread-safe builds alloc_trim_start() runs a background thread that trims the arenas nobody is using every so often.
+ */
+
+#include "main.h"
+
+#include <time.h>
+
+/*
+ * Releases the pages lying entirely inside free block `hdr` of chunk `c` that are not released yet.
+ * The pages holding the block's header and tree node and its footer stay, as do pages past the chunk's high-water mark,
+ * which were never used and so were never resident in the first place.
+ * Returns the number of pages released.
+ */
+static word trimBlock(chunk *c, header *hdr, size_t page)
+{
+#ifdef ALLOC_HUGEPAGES
+    // Explicit hugepages can only be released whole, which a free block rarely spans; they stay with the heap.
+    if (c->hugetlb)
+        return 0;
+#endif
+
+    size_t from = ((size_t)(nodeof(hdr) + 1) + page - 1) & ~(page - 1);
+    size_t to = ((size_t)hdr + ((word)hdr->w - 1) * Wordbytes) & ~(page - 1);
+    size_t clean = ((size_t)c->clean + page - 1) & ~(page - 1);
+    if (to > clean)
+        to = clean;
+
+    word pages = 0;
+    for (size_t p = from; p < to;)
+    {
+        word i = pageIn(c, p, page);
+        if (c->pagemap[i / Wordbits] & (word)1 << (i % Wordbits))
+        {
+            p += page;
+            continue;
+        }
+
+        // Release the whole run of pages up to the next one that is released already, with one call.
+        size_t end = p;
+        word n = 0;
+        while (end < to && !(c->pagemap[(i + n) / Wordbits] & (word)1 << ((i + n) % Wordbits)))
+        {
+            end += page;
+            n++;
+        }
+
+        if (madvise((void *)p, end - p, Trimadvice))
+        {
+            trace(TraceErr, "trim: Error: madvise of %zu bytes at %p failed (errno %d).\n", end - p, (void *)p, errno);
+            return pages;
+        }
+
+        for (word k = i; k < i + n; k++)
+            c->pagemap[k / Wordbits] |= (word)1 << (k % Wordbits);
+        c->released += n;
+        pages += n;
+        p = end;
+    }
+
+    return pages;
+}
+
+/*
+ * Trims every free block of the size tree rooted at `hdr`. The caller must hold the lock of the arena the tree belongs to.
+ * A block holding a whole page plus its header, tree node and footer is always at least Treewords words, hence in the tree.
+ * Returns the number of pages released.
+ */
+static word trimTree(header *hdr, size_t page)
+{
+    word pages = 0;
+
+    for (; hdr; hdr = nodeof(hdr)->child[1])
+    {
+        pages += trimTree(nodeof(hdr)->child[0], page);
+        pages += trimBlock(chunkOf(hdr), hdr, page);
+    }
+
+    return pages;
+}
+
+/*
+ * Trims every arena; arenas whose lock is taken are skipped unless `wait` is set, so a background trim never holds up allocations.
+ * Each arena's remote stack is drained first, so an arena whose threads have gone idle gives back what others freed for it.
+ * Returns the number of bytes released.
+ */
+static size_t trimArenas(bool wait)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t bytes = 0;
+
+    if (page < Minpage)
+        return 0;
+
+    for (word i = 0; i < Arenas; i++)
+    {
+        arena *a = &arenas[i];
+
+#ifdef ALLOC_THREADS
+        if (!wait && pthread_mutex_trylock(&a->lock))
+            continue;
+        if (wait)
+            lockarena(a);
+#else
+        (void)wait;
+#endif
+        // Blocks freed by other threads are still queued on the remote stack, holding their pages as if in use.
+        remoteDrain_(a);
+#ifdef ALLOC_DEFER
+        // Blocks parked for deferred coalescing would keep the free blocks around them in pieces.
+        fastConsolidate_(a);
+#endif
+        bytes += trimTree(a->tree, page) * page;
+        unlockarena(a);
+    }
+
+    if (bytes)
+        trace(TraceOps, "trim: Released %zu bytes to the OS.\n", bytes);
+    return bytes;
+}
+
+/*
+ * Releases the pages of every free block of the heap to the OS, so the program's resident set drops by that much.
+ * Released memory stays part of the heap and is reused as it is, with the pages faulted back in (zeroed) when they are touched.
+ * Fully free mapped chunks are already unmapped when they become free, so this covers what remains: large holes in the chunks.
+ * Returns the number of bytes released by this call; pages released by an earlier call are not counted again.
+ */
+size_t alloc_trim(void)
+{
+    return trimArenas(true);
+}
+
+#ifdef ALLOC_THREADS
+static pthread_t trimmer;
+static pthread_mutex_t trimlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trimwake = PTHREAD_COND_INITIALIZER; // Signalled by alloc_trim_stop to end the wait early.
+static bool trimming;   // The trimmer thread keeps running while set (protected by trimlock).
+static word trimperiod; // Milliseconds between two trims.
+
+static void *trimLoop(void *arg unused)
+{
+    pthread_mutex_lock(&trimlock);
+    while (trimming)
+    {
+        struct timespec at;
+        clock_gettime(CLOCK_REALTIME, &at);
+        at.tv_sec += trimperiod / 1000;
+        at.tv_nsec += (long)(trimperiod % 1000) * 1000000;
+        if (at.tv_nsec >= 1000000000)
+        {
+            at.tv_sec++;
+            at.tv_nsec -= 1000000000;
+        }
+
+        if (pthread_cond_timedwait(&trimwake, &trimlock, &at) == 0 || !trimming)
+            continue;
+
+        pthread_mutex_unlock(&trimlock);
+        trimArenas(false);
+        pthread_mutex_lock(&trimlock);
+    }
+    pthread_mutex_unlock(&trimlock);
+
+    return NULL;
+}
+
+/*
+ * Starts a background thread that trims the heap (see alloc_trim) every `period_ms` milliseconds (0 for Trimperiod).
+ * Arenas that are locked when their turn comes are left for the next round, so only idle memory is released.
+ * alloc_trim_start and alloc_trim_stop are meant to be called while no other thread starts or stops the trimmer.
+ * Returns false with errno set (ErrInval if the trimmer is already running, ErrNoMem if the thread cannot be created).
+ */
+bool alloc_trim_start(word period_ms)
+{
+    pthread_mutex_lock(&trimlock);
+    if (trimming)
+    {
+        pthread_mutex_unlock(&trimlock);
+        trace(TraceErr, "trim: Error: The background trimmer is already running.\n");
+        errno = ErrInval;
+        return false;
+    }
+    trimperiod = period_ms ? period_ms : Trimperiod;
+    trimming = true;
+    pthread_mutex_unlock(&trimlock);
+
+    if (pthread_create(&trimmer, NULL, trimLoop, NULL))
+    {
+        pthread_mutex_lock(&trimlock);
+        trimming = false;
+        pthread_mutex_unlock(&trimlock);
+        errno = ErrNoMem;
+        return false;
+    }
+
+    trace(TraceOps, "trim: Trimming idle arenas every %lu ms.\n", trimperiod);
+    return true;
+}
+
+/*
+ * Stops the background trimmer and waits for it to finish the round it may be in. Does nothing if it is not running.
+ */
+void alloc_trim_stop(void)
+{
+    pthread_mutex_lock(&trimlock);
+    if (!trimming)
+    {
+        pthread_mutex_unlock(&trimlock);
+        return;
+    }
+    trimming = false;
+    pthread_cond_signal(&trimwake);
+    pthread_mutex_unlock(&trimlock);
+
+    pthread_join(trimmer, NULL);
+    trace(TraceOps, "trim: Stopped the background trimmer.\n");
+}
+#endif